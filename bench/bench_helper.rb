@@ -0,0 +1,83 @@
+# frozen_string_literal: true
+
+require "json"
+require "time"
+require "vernier"
+
+# Shared harness for the benchmarks in this directory. Each measurement is
+# written as one line of JSON to $stdout (or appended to BENCH_OUT), so that
+# runs against different releases can be collected and compared. A readable
+# summary goes to $stderr.
+module Bench
+  ITERATIONS = Integer(ENV.fetch("BENCH_ITERATIONS", 5))
+
+  # Larger sizes are skipped unless BENCH_LARGE is set, as they take a while
+  LARGE = !!ENV["BENCH_LARGE"]
+
+  def self.now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+  end
+
+  def self.time
+    start = now
+    yield
+    now - start
+  end
+
+  def self.environment
+    @environment ||= {
+      vernier: Vernier::VERSION,
+      ruby: RUBY_DESCRIPTION,
+      platform: RUBY_PLATFORM,
+      revision: `git -C #{__dir__} rev-parse --short HEAD 2>/dev/null`.chomp,
+      time: Time.now.utc.iso8601
+    }
+  end
+
+  def self.out
+    @out ||= ENV["BENCH_OUT"] ? File.open(ENV["BENCH_OUT"], "a") : $stdout
+  end
+
+  # Writes a measurement. Values ending in _ns are times in nanoseconds.
+  def self.report(name, params = {}, values)
+    out.puts JSON.generate(environment.merge(name:, params:).merge(values))
+    out.flush
+
+    summary = values.map do |key, value|
+      if key.end_with?("_ns")
+        value = value >= 1_000_000 ? "%.2fms" % (value / 1_000_000.0) : "%.2fus" % (value / 1_000.0)
+      end
+      "#{key}=#{value}"
+    end
+    $stderr.puts "#{name} #{params.map { |k, v| "#{k}=#{v}" }.join(" ")}: #{summary.join(" ")}"
+  end
+
+  # Runs the block ITERATIONS times (after a warmup) and reports the median
+  # and fastest times. The block may return a Hash of extra values, which are
+  # the median of each across iterations.
+  def self.measure(name, params = {}, iterations: ITERATIONS)
+    yield
+    times = []
+    extras = Hash.new { |h, k| h[k] = [] }
+    iterations.times do
+      extra = nil
+      times << time { extra = yield }
+      extra.each { |key, value| extras[key] << value } if extra.is_a?(Hash)
+    end
+
+    values = { iterations:, median_ns: median(times), min_ns: times.min }
+    extras.each { |key, list| values[key] = median(list) }
+    report(name, params, values)
+  end
+
+  def self.median(values)
+    sorted = values.sort
+    mid = sorted.size / 2
+    sorted.size.odd? ? sorted[mid] : (sorted[mid - 1] + sorted[mid]) / 2
+  end
+
+  # Calls the block +depth+ frames deeper than the caller
+  def self.at_depth(depth, &block)
+    depth <= 1 ? block.call : at_depth(depth - 1, &block)
+  end
+end
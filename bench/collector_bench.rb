@@ -0,0 +1,113 @@
+# frozen_string_literal: true
+
+# Microbenchmarks for the collector's hot paths
+#
+#   ruby -Ilib bench/collector_bench.rb
+
+require_relative "bench_helper"
+
+module CollectorBench
+  # Runs on its own thread while a wall collector samples it. Alternates
+  # between two branches of +unshared+ frames on top of a common stack, so
+  # that consecutive samples only share part of their stack.
+  def self.alternate(depth, unshared, stop)
+    Bench.at_depth(depth - unshared) do
+      flip = false
+      until stop.call
+        flip = !flip
+        flip ? branch_a(unshared) : branch_b(unshared)
+      end
+    end
+  end
+
+  def self.branch_a(n) = n <= 0 ? spin : branch_a(n - 1)
+  def self.branch_b(n) = n <= 0 ? spin : branch_b(n - 1)
+
+  def self.spin
+    i = 0
+    i += 1 while i < 1000
+  end
+
+  # SampleTranslator::translate, from the sampler's own accounting
+  def self.translate
+    [10, 100, 500].product([1.0, 0.5, 0.0]) do |depth, shared|
+      unshared = (depth * (1 - shared)).to_i
+      Bench.measure("translate", { depth:, shared: }) do
+        collector = Vernier::Collector.new(:wall, interval: 200)
+        collector.start
+        finish = Bench.now + 300_000_000
+        alternate(depth, unshared, -> { Bench.now > finish })
+        stats = collector.stop.meta[:profiler]
+
+        {
+          ticks: stats[:ticks],
+          stack_nodes: stats[:stack_nodes],
+          translate_per_tick_ns: stats[:translate_ns] / [stats[:ticks], 1].max
+        }
+      end
+    end
+  end
+
+  # FrameList::stack_index and SampleList::record_sample, through the custom
+  # collector's manual sampling
+  SAMPLES = 10_000
+  def self.record_sample
+    [10, 100, 500].each do |depth|
+      Bench.measure("record_sample", { depth:, samples: SAMPLES }) do
+        collector = Vernier::Collector.new(:custom)
+        collector.start
+        Bench.at_depth(depth) { SAMPLES.times { collector.sample } }
+        collector.stop
+        nil
+      end
+    end
+  end
+
+  # A method sampling once per line has a distinct frame for each line
+  def self.define_sampler(lines)
+    name = :"sample_#{lines}_lines"
+    return name if respond_to?(name)
+
+    body = "c.sample\n" * lines
+    singleton_class.class_eval("def #{name}(c)\n#{body}end", __FILE__, __LINE__)
+    name
+  end
+
+  # FrameList::finalize and write_result, and Output::Firefox#output on
+  # their result
+  def self.finalize
+    sizes = [10_000, 100_000]
+    sizes << 1_000_000 if Bench::LARGE
+
+    sizes.each do |frames|
+      sampler = define_sampler(frames)
+      result = nil
+      Bench.measure("stop", { frames: }) do
+        collector = Vernier::Collector.new(:custom)
+        collector.start
+        send(sampler, collector)
+        stop_ns = Bench.time { result = collector.stop }
+        stats = result.meta[:profiler]
+
+        {
+          stop_ns:,
+          finalize_ns: stats[:finalize_ns],
+          write_result_ns: stats[:write_result_ns]
+        }
+      end
+
+      Bench.measure("firefox_output", { frames: }) do
+        Vernier::Output::Firefox.new(result).output
+        nil
+      end
+    end
+  end
+
+  def self.run
+    translate
+    record_sample
+    finalize
+  end
+end
+
+CollectorBench.run
@@ -0,0 +1,117 @@
+# frozen_string_literal: true
+
+# End-to-end profiling overhead: the same workloads with and without a
+# collector running, across thread counts
+#
+#   ruby -Ilib bench/overhead_bench.rb
+
+require_relative "bench_helper"
+require "erb"
+require "net/http"
+require "socket"
+
+module OverheadBench
+  # Like examples/threaded_http_requests.rb, but against a local server so
+  # that it's reproducible
+  class RequestsWorkload
+    REQUESTS = 400
+
+    def initialize
+      @server = TCPServer.new("127.0.0.1", 0)
+      @port = @server.addr[1]
+      @acceptor = Thread.new do
+        while (socket = @server.accept)
+          Thread.new(socket) { |s| respond(s) }
+        end
+      rescue IOError
+      end
+    end
+
+    def respond(socket)
+      while (line = socket.gets) && line != "\r\n"
+      end
+      body = "hello" * 100
+      socket.write "HTTP/1.1 200 OK\r\nContent-Length: #{body.bytesize}\r\nConnection: close\r\n\r\n#{body}"
+    ensure
+      socket.close
+    end
+
+    def call(threads)
+      uri = URI("http://127.0.0.1:#{@port}/")
+      queue = Queue.new
+      REQUESTS.times { queue << uri }
+      queue.close
+
+      threads.times.map do
+        Thread.new do
+          while (uri = queue.pop)
+            Net::HTTP.get_response(uri)
+          end
+        end
+      end.each(&:join)
+    end
+
+    def close
+      @server.close
+      @acceptor.join
+    end
+  end
+
+  # Like examples/rails.rb, rendering a view of some records on each thread
+  class RenderWorkload
+    RENDERS = 400
+    TEMPLATE = ERB.new(<<~HTML)
+      <ul>
+      <% records.each do |record| %>
+        <li id="<%= record[:id] %>"><%= ERB::Util.html_escape(record[:title]) %> (<%= record[:tags].join(", ") %>)</li>
+      <% end %>
+      </ul>
+    HTML
+
+    def initialize
+      @records = 50.times.map { |i| { id: i, title: "Record <#{i}>", tags: %w[a b c].rotate(i) } }
+    end
+
+    def call(threads)
+      per_thread = RENDERS / threads
+      threads.times.map do
+        Thread.new do
+          records = @records
+          per_thread.times { JSON.generate(TEMPLATE.result(binding)) }
+        end
+      end.each(&:join)
+    end
+
+    def close
+    end
+  end
+
+  MODES = [nil, :wall]
+  MODES << :cpu if RUBY_PLATFORM.include?("linux")
+
+  def self.run
+    { requests: RequestsWorkload, render: RenderWorkload }.each do |name, klass|
+      workload = klass.new
+      [1, 4, 16].each do |threads|
+        MODES.each do |mode|
+          params = { workload: name, threads:, mode: mode || :none }
+          Bench.measure("overhead", params) do
+            if mode
+              collector = Vernier::Collector.new(mode)
+              collector.start
+              run_ns = Bench.time { workload.call(threads) }
+              stop_ns = Bench.time { collector.stop }
+              { run_ns:, stop_ns: }
+            else
+              { run_ns: Bench.time { workload.call(threads) } }
+            end
+          end
+        end
+      end
+    ensure
+      workload&.close
+    end
+  end
+end
+
+OverheadBench.run
@@ -9,7 +9,17 @@ have_header("ruby/thread.h")
 have_struct_member("rb_internal_thread_event_data_t", "thread", ["ruby/thread.h"])
 
 have_func("rb_profile_thread_frames", "ruby/debug.h")
+have_func("rb_postponed_job_preregister", "ruby/debug.h")
 
 have_func("pthread_setname_np")
 
+# For the :cpu collector's per-thread timers. Older glibc has these in librt.
+have_library("rt", "timer_create")
+have_func("timer_create", "time.h")
+
+# For native: true, finding and symbolicating native frames
+have_func("dl_iterate_phdr", "link.h")
+have_library("dl", "dladdr")
+have_func("dladdr", "dlfcn.h")
+
 create_makefile("vernier/vernier")
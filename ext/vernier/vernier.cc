@@ -6,13 +6,16 @@
 #include <memory>
 #include <algorithm>
 #include <sstream>
+#include <map>
 #include <unordered_map>
 #include <unordered_set>
 #include <cassert>
 #include <atomic>
 #include <mutex>
+#include <random>
 
 #include <sys/time.h>
+#include <time.h>
 #include <signal.h>
 #ifdef __APPLE__
 /* macOS */
@@ -25,6 +28,23 @@
 
 #include "vernier.hh"
 
+// Per-thread CPU time timers, for the :cpu collector
+#if defined(__linux__) && HAVE_TIMER_CREATE && defined(SIGEV_THREAD_ID)
+#define HAVE_CPU_TIMERS 1
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+// Frame pointer walks of the native stack, for native: true
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && HAVE_DL_ITERATE_PHDR && HAVE_DLADDR
+#define HAVE_NATIVE_STACKS 1
+#include <link.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+#include <cxxabi.h>
+#endif
+
 #include "ruby/ruby.h"
 #include "ruby/debug.h"
 #include "ruby/thread.h"
@@ -58,7 +78,7 @@ static VALUE rb_cVernierResult;
 static VALUE rb_mVernierMarkerType;
 static VALUE rb_cVernierCollector;
 
-static const char *gvl_event_name(rb_event_flag_t event) {
+__attribute__((unused)) static const char *gvl_event_name(rb_event_flag_t event) {
     switch (event) {
       case RUBY_INTERNAL_THREAD_EVENT_STARTED:
         return "started";
@@ -94,16 +114,28 @@ class TimeStamp {
     }
 
     // SleepUntil a specified timestamp
-    // Highly accurate manual sleep time
+    // Blocks on the monotonic clock until the deadline, so the calling thread
+    // costs nothing while waiting.
     static void SleepUntil(const TimeStamp &target_time) {
         if (target_time.zero()) return;
+
+#ifdef __APPLE__
+        // macOS has no clock_nanosleep, so sleep for the relative remainder
+        // (re-checking in case we were woken early by a signal)
+        TimeStamp now = TimeStamp::Now();
+        while (target_time > now) {
+            struct timespec ts = (target_time - now).timespec();
+            nanosleep(&ts, NULL);
+            now = TimeStamp::Now();
+        }
+#else
         struct timespec ts = target_time.timespec();
 
         int res;
         do {
-            // do nothing until it's time :)
-            sleep(0);
-        } while (target_time > TimeStamp::Now());
+            res = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        } while (res == EINTR);
+#endif
     }
 
     static TimeStamp from_seconds(uint64_t s) {
@@ -197,13 +229,19 @@ std::ostream& operator<<(std::ostream& os, const TimeStamp& info) {
     return os;
 }
 
+// Stands in for the root frames of a stack deeper than a collector's
+// max_depth. Never a frame VALUE, and ignored by the GC.
+#define TRUNCATED_FRAME Qundef
+
 struct FrameInfo {
     static const char *label_cstr(VALUE frame) {
+        if (frame == TRUNCATED_FRAME) return "(truncated)";
         VALUE label = rb_profile_frame_full_label(frame);
         return StringValueCStr(label);
     }
 
     static const char *file_cstr(VALUE frame) {
+        if (frame == TRUNCATED_FRAME) return "";
         VALUE file = rb_profile_frame_absolute_path(frame);
         if (NIL_P(file))
             file = rb_profile_frame_path(frame);
@@ -215,34 +253,16 @@ struct FrameInfo {
     }
 
     static int first_lineno_int(VALUE frame) {
+        if (frame == TRUNCATED_FRAME) return 0;
         VALUE first_lineno = rb_profile_frame_first_lineno(frame);
         return NIL_P(first_lineno) ? 0 : FIX2INT(first_lineno);
     }
 
-    FrameInfo(VALUE frame) :
-        label(label_cstr(frame)),
-        file(file_cstr(frame)),
-        first_lineno(first_lineno_int(frame)) { }
-
-    std::string label;
-    std::string file;
-    int first_lineno;
 };
 
-bool operator==(const FrameInfo& lhs, const FrameInfo& rhs) noexcept {
-    return
-        lhs.label == rhs.label &&
-        lhs.file == rhs.file &&
-        lhs.first_lineno == rhs.first_lineno;
-}
-
 struct Frame {
     VALUE frame;
     int line;
-
-    FrameInfo info() const {
-        return FrameInfo(frame);
-    }
 };
 
 bool operator==(const Frame& lhs, const Frame& rhs) noexcept {
@@ -253,13 +273,24 @@ bool operator!=(const Frame& lhs, const Frame& rhs) noexcept {
     return !(lhs == rhs);
 }
 
+// Finalizer from MurmurHash3. Pointers are aligned so their low bits carry
+// almost no information, this spreads every input bit over the output.
+static inline uint64_t mix_hash(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
 namespace std {
     template<>
     struct hash<Frame>
     {
         std::size_t operator()(Frame const& s) const noexcept
         {
-            return s.frame ^ s.line;
+            return mix_hash(s.frame ^ mix_hash((uint32_t)s.line));
         }
     };
 }
@@ -295,10 +326,6 @@ class SamplerSemaphore {
 #ifdef __APPLE__
         dispatch_semaphore_wait(sem, DISPATCH_TIME_FOREVER);
 #else
-        // Use sem_timedwait so that we get a crash instead of a deadlock for
-        // easier debugging
-        auto ts = (TimeStamp::Now() + TimeStamp::from_seconds(5)).timespec();
-
         int ret;
         do {
             ret = sem_wait(&sem);
@@ -316,43 +343,402 @@ class SamplerSemaphore {
     }
 };
 
+#if HAVE_NATIVE_STACKS
+// Bounds of the current thread's stack, found by
+// NativeStack::prepare_current_thread. Zero until then. Read by signal
+// handlers, see prepare_thread_locals.
+static __thread uintptr_t native_stack_low = 0;
+static __thread uintptr_t native_stack_high = 0;
+
+// Walks the native stack of a thread interrupted by a signal, following the
+// chain of saved frame pointers from the registers in its ucontext. Only the
+// frames above the Ruby interpreter are kept: those are what a C extension
+// (and whatever it calls) is doing inside the current cfunc, while the
+// interpreter's own frames below only repeat the Ruby stack.
+//
+// Each frame is checked before it's read, to be within the thread's stack
+// and to return into a loaded object's code, so a library built without
+// frame pointers ends the walk early rather than crashing it.
+class NativeStack {
+    public:
+        // Native frames are stored among a sample's frame VALUEs as their
+        // address tagged as a Fixnum, so they can't be mistaken for a Ruby
+        // frame and are ignored by the GC.
+        static VALUE frame_value(uintptr_t pc) {
+            return (VALUE)((pc << 1) | FIXNUM_FLAG);
+        }
+
+        static bool is_frame(VALUE frame) {
+            return FIXNUM_P(frame);
+        }
+
+        static uintptr_t address(VALUE frame) {
+            return (uintptr_t)frame >> 1;
+        }
+
+        // Must be called on each thread before its native stack can be
+        // walked (further than the interrupted frame), as finding the
+        // thread's stack isn't async-signal-safe
+        static void prepare_current_thread() {
+            if (native_stack_high) return;
+
+            pthread_attr_t attr;
+            if (pthread_getattr_np(pthread_self(), &attr) != 0) return;
+
+            void *addr;
+            size_t size;
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                native_stack_low = (uintptr_t)addr;
+                native_stack_high = (uintptr_t)addr + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+
+        // Snapshots the executable segments of every loaded object. Walks
+        // stop at code loaded since, until this is called again. Must hold
+        // the GVL.
+        static void load_segments() {
+            Segments *loaded = new Segments();
+            dl_iterate_phdr(add_object_segments, loaded);
+            std::sort(loaded->begin(), loaded->end(), [](const Segment &a, const Segment &b) {
+                return a.start < b.start;
+            });
+
+            const Segments *current = segments.load(std::memory_order_acquire);
+            if (current && *current == *loaded) {
+                delete loaded;
+                return;
+            }
+
+            // The previous snapshot is leaked, as a signal handler could
+            // still be reading it. This only happens when objects have been
+            // loaded between native collectors starting.
+            segments.store(loaded, std::memory_order_release);
+        }
+
+        // Writes up to capacity frames, leaf first, returning how many.
+        // Async-signal-safe.
+        static int walk(void *ucontext, VALUE *frames, int *lines, int capacity) {
+            const Segments *loaded = segments.load(std::memory_order_acquire);
+            if (!loaded) return 0;
+
+            const ucontext_t *uc = static_cast<const ucontext_t *>(ucontext);
+#if defined(__x86_64__)
+            uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+            uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+#else
+            uintptr_t pc = uc->uc_mcontext.pc;
+            uintptr_t fp = uc->uc_mcontext.regs[29];
+#endif
+            uintptr_t low = native_stack_low;
+            uintptr_t high = native_stack_high;
+
+            int count = 0;
+            while (count < capacity) {
+                const Segment *segment = find(*loaded, pc);
+                if (!segment || segment->interpreter) break;
+
+                frames[count] = frame_value(pc);
+                lines[count] = 0;
+                count++;
+
+                // Each frame record holds the caller's frame pointer, then
+                // the return address, and callers are further up the stack
+                if (!high || fp < low || fp > high - 2 * sizeof(uintptr_t) || fp % sizeof(uintptr_t)) break;
+                const uintptr_t *record = reinterpret_cast<const uintptr_t *>(fp);
+                if (record[0] <= fp) break;
+
+                // The return address is just past the call, which could be
+                // the start of the next function
+                pc = record[1] - 1;
+                fp = record[0];
+            }
+            return count;
+        }
+
+        // A native frame's function, as found by dladdr. Frames in the same
+        // function share a key.
+        struct Symbol {
+            VALUE key;
+            std::string name;
+            std::string file;
+        };
+
+        static Symbol symbolicate(VALUE frame) {
+            uintptr_t pc = address(frame);
+
+            Dl_info info;
+            if (!dladdr((void *)pc, &info) || !info.dli_fname) {
+                return Symbol{frame, hex(pc), ""};
+            }
+
+            std::string file = info.dli_fname;
+            if (!info.dli_sname) {
+                // Not exported, so all we can say is which object it's in.
+                // These are all one func, rather than one for each address.
+                std::string base = file.substr(file.rfind('/') + 1);
+                return Symbol{frame_value((uintptr_t)info.dli_fbase), base, file};
+            }
+
+            std::string name = info.dli_sname;
+            int status;
+            char *demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+            if (demangled) {
+                name = demangled;
+                free(demangled);
+            }
+            return Symbol{frame_value((uintptr_t)info.dli_saddr), name, file};
+        }
+
+    private:
+        struct Segment {
+            uintptr_t start;
+            uintptr_t end;
+
+            // Part of the object the Ruby VM is in
+            bool interpreter;
+
+            bool operator==(const Segment &other) const {
+                return start == other.start && end == other.end && interpreter == other.interpreter;
+            }
+        };
+        typedef std::vector<Segment> Segments;
+
+        static std::atomic<const Segments *> segments;
+
+        static const Segment *find(const Segments &loaded, uintptr_t pc) {
+            auto it = std::upper_bound(loaded.begin(), loaded.end(), pc, [](uintptr_t pc, const Segment &segment) {
+                return pc < segment.start;
+            });
+            if (it == loaded.begin()) return NULL;
+            --it;
+            return pc < it->end ? &*it : NULL;
+        }
+
+        static int add_object_segments(struct dl_phdr_info *info, size_t, void *data) {
+            Segments *loaded = static_cast<Segments *>(data);
+            uintptr_t interpreter = (uintptr_t)&rb_profile_frames;
+
+            size_t first = loaded->size();
+            bool is_interpreter = false;
+            for (int i = 0; i < info->dlpi_phnum; i++) {
+                const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+                if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X)) continue;
+
+                uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+                uintptr_t end = start + phdr.p_memsz;
+                loaded->push_back(Segment{start, end, false});
+                if (interpreter >= start && interpreter < end) is_interpreter = true;
+            }
+            for (size_t i = first; i < loaded->size(); i++) {
+                (*loaded)[i].interpreter = is_interpreter;
+            }
+            return 0;
+        }
+
+        static std::string hex(uintptr_t value) {
+            std::stringstream ss;
+            ss << "0x" << std::hex << value;
+            return ss.str();
+        }
+};
+std::atomic<const NativeStack::Segments *> NativeStack::segments{NULL};
+#endif
+
+// The label set of whatever the current thread is doing, see
+// Vernier.with_label. Zero means unlabelled.
+//
+// Signal handlers read this. As we're loaded with dlopen, a thread's TLS
+// block may only be allocated on its first access, which isn't
+// async-signal-safe. (The initial-exec model avoids that, but takes from the
+// loader's small static TLS reserve, which can run out when many extensions
+// are loaded.) So every thread makes that first access in
+// prepare_thread_locals before it can be sampled.
+static __thread int current_label_id = 0;
+
+// Called on each thread, outside of any signal handler, before it can be
+// signalled
+static void prepare_thread_locals() {
+    (void)*(volatile int *)&current_label_id;
+#if HAVE_NATIVE_STACKS
+    (void)*(volatile uintptr_t *)&native_stack_low;
+    (void)*(volatile uintptr_t *)&native_stack_high;
+#endif
+}
+
+// Every set of labels used with Vernier.with_label, interned once for the
+// life of the process so that setting one is just storing its id. Sets are
+// sorted by key, and the empty set is always id 0. Only used with the GVL.
+class LabelTable {
+    public:
+        typedef std::vector<std::pair<std::string, std::string>> LabelSet;
+
+        static LabelTable &instance() {
+            static LabelTable table;
+            return table;
+        }
+
+        // The id of base's labels with those in hash added, replacing any
+        // with the same keys
+        int intern(int base, VALUE hash) {
+            std::map<std::string, std::string> merged(sets.at(base).begin(), sets.at(base).end());
+            rb_hash_foreach(hash, add_label_i, (VALUE)&merged);
+
+            std::string key;
+            for (auto &pair : merged) {
+                key.append(pair.first);
+                key.push_back('\0');
+                key.append(pair.second);
+                key.push_back('\0');
+            }
+
+            auto inserted = index.emplace(key, (int)sets.size());
+            if (inserted.second) {
+                sets.emplace_back(merged.begin(), merged.end());
+            }
+            return inserted.first->second;
+        }
+
+        bool valid(int id) const {
+            return id >= 0 && (size_t)id < sets.size();
+        }
+
+        VALUE to_hash(int id) const {
+            VALUE hash = rb_hash_new();
+            for (auto &pair : sets.at(id)) {
+                rb_hash_aset(hash, ID2SYM(rb_intern2(pair.first.data(), pair.first.size())), rb_str_new(pair.second.data(), pair.second.size()));
+            }
+            return hash;
+        }
+
+    private:
+        std::vector<LabelSet> sets{LabelSet()};
+        std::unordered_map<std::string, int> index{{"", 0}};
+
+        static int add_label_i(VALUE key, VALUE value, VALUE arg) {
+            auto *merged = reinterpret_cast<std::map<std::string, std::string> *>(arg);
+            VALUE key_str = rb_obj_as_string(key);
+            VALUE value_str = rb_obj_as_string(value);
+            (*merged)[std::string(RSTRING_PTR(key_str), RSTRING_LEN(key_str))] = std::string(RSTRING_PTR(value_str), RSTRING_LEN(value_str));
+            return ST_CONTINUE;
+        }
+};
+
+// A stack as captured by rb_profile_frames, leaf first. Stacks deeper than
+// max_depth keep their max_depth leaf frames, under a TRUNCATED_FRAME root.
+//
+// The buffers are allocated up front as samples are taken in signal
+// handlers. Being on the heap also keeps them out of sight of the
+// conservative GC.
 struct RawSample {
-    constexpr static int MAX_LEN = 2048;
-    VALUE frames[MAX_LEN];
-    int lines[MAX_LEN];
+    constexpr static int DEFAULT_MAX_DEPTH = 2048;
+
+    // Room for one frame more than max_depth, so that we can tell when a
+    // stack was cut short
+    std::vector<VALUE> frames;
+    std::vector<int> lines;
     int len;
     bool gc;
+    bool truncated;
+
+    // The sampled thread's current_label_id
+    int label;
+
+    // Whether samples taken in a signal handler start with the native
+    // frames above the interpreter (see NativeStack), and how many of the
+    // leaf frames are native
+    bool native;
+    int native_len;
 
-    RawSample() : len(0), gc(false) { }
+    RawSample(int max_depth = DEFAULT_MAX_DEPTH, bool native = false) : len(0), gc(false), truncated(false), label(0), native(native), native_len(0) {
+        frames.resize(max_depth + 1);
+        lines.resize(max_depth + 1);
+    }
+
+    int max_depth() const {
+        return frames.size() - 1;
+    }
 
     int size() const {
-        return len;
+        return len + truncated;
     }
 
+    // Frames are indexed from the root
     Frame frame(int i) const {
+        if (truncated) {
+            if (i == 0) return Frame{TRUNCATED_FRAME, 0};
+            i--;
+        }
         int idx = len - i - 1;
         if (idx < 0) throw std::out_of_range("out of range");
         const Frame frame = {frames[idx], lines[idx]};
         return frame;
     }
 
-    void sample() {
+    // Signal handlers pass the interrupted context, for native frames
+    void sample(void *ucontext = NULL) {
         clear();
 
         if (!ruby_native_thread_p()) {
             return;
         }
 
+        label = current_label_id;
+
         if (rb_during_gc()) {
           gc = true;
         } else {
-          len = rb_profile_frames(0, MAX_LEN, frames, lines);
+#if HAVE_NATIVE_STACKS
+          if (native && ucontext) {
+              native_len = NativeStack::walk(ucontext, frames.data(), lines.data(), frames.size());
+          }
+#endif
+          len = native_len + rb_profile_frames(0, frames.size() - native_len, frames.data() + native_len, lines.data() + native_len);
+          truncate();
+        }
+    }
+
+#if HAVE_RB_PROFILE_THREAD_FRAMES
+    // Sample a thread other than the current one. The thread must not be
+    // able to run Ruby code while this happens, ie. it's suspended and
+    // blocked from changing state.
+    void sample_thread(VALUE thread) {
+        clear();
+
+        len = rb_profile_thread_frames(thread, 0, frames.size(), frames.data(), lines.data());
+        truncate();
+    }
+#endif
+
+    // Copies another sample, keeping as many of its leaf frames as fit.
+    // Its native frames are dropped unless this sample takes them too.
+    void copy_from(const RawSample &other) {
+        int skip = native ? 0 : other.native_len;
+        int available = other.len - skip;
+        int count = available < max_depth() ? available : max_depth();
+        std::copy(other.frames.begin() + skip, other.frames.begin() + skip + count, frames.begin());
+        std::copy(other.lines.begin() + skip, other.lines.begin() + skip + count, lines.begin());
+        len = count;
+        native_len = std::min(other.native_len - skip, count);
+        gc = other.gc;
+        truncated = other.truncated || count < available;
+        label = other.label;
+    }
+
+    void truncate() {
+        if (len > max_depth()) {
+            len = max_depth();
+            native_len = std::min(native_len, len);
+            truncated = true;
         }
     }
 
     void clear() {
         len = 0;
+        native_len = 0;
         gc = false;
+        truncated = false;
+        label = 0;
     }
 
     bool empty() const {
@@ -364,36 +750,155 @@ struct RawSample {
 // This is used for communication between the profiler thread and the signal
 // handlers in the observed thread.
 struct LiveSample {
-    RawSample sample;
+    // Where the signal handler should write the sample. This is set by the
+    // profiler thread before signalling and is usually a slot in a
+    // SampleQueue.
+    RawSample *sample = NULL;
+
+    // The thread to be sampled, which finds its LiveSample by this
+    pthread_t pthread_id;
 
     SamplerSemaphore sem_complete;
 
+    // How long the signal handler took to take the last sample
+    TimeStamp handler_duration;
+
     // Wait for a sample to be collected by the signal handler on another thread
     void wait() {
         sem_complete.wait();
     }
 
-    int size() const {
-        return sample.size();
-    }
-
-    Frame frame(int i) const {
-        return sample.frame(i);
-    }
-
     // Called from a signal handler in the observed thread in order to take a
     // sample and signal to the proifiler thread that the sample is ready.
     //
     // CRuby doesn't guarantee that rb_profile_frames can be used as
     // async-signal-safe but in practice it seems to be.
     // sem_post is safe in an async-signal-safe context.
-    void sample_current_thread() {
-        sample.sample();
+    void sample_current_thread(void *ucontext) {
+        // clock_gettime is async-signal-safe
+        TimeStamp start = TimeStamp::Now();
+        sample->sample(ucontext);
+        handler_duration = TimeStamp::Now() - start;
         sem_complete.post();
     }
 };
 
+// Result columns are written either as Arrays of Integers, or for collectors
+// started with packed: true, as binary Strings of native-endian values.
+// Packed columns avoid allocating an object per element in stop(), and are
+// unpacked into Arrays by Vernier::Result the first time they're read.
+//
+// In both forms a negative value in a nil_negative column stands for nil.
+static VALUE int_column(const std::vector<int32_t> &values, bool packed, bool nil_negative = false) {
+    if (packed) {
+        return rb_str_new(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(int32_t));
+    }
+
+    VALUE ary = rb_ary_new_capa(values.size());
+    for (int32_t value : values) {
+        rb_ary_push(ary, (nil_negative && value < 0) ? Qnil : INT2NUM(value));
+    }
+    return ary;
+}
+
+static VALUE uint64_column(const std::vector<uint64_t> &values, bool packed) {
+    if (packed) {
+        return rb_str_new(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(uint64_t));
+    }
+
+    VALUE ary = rb_ary_new_capa(values.size());
+    for (uint64_t value : values) {
+        rb_ary_push(ary, ULL2NUM(value));
+    }
+    return ary;
+}
+
+// Each distinct frame VALUE the stack table has ever referred to, for GC
+// marking. Stack nodes share frames heavily, so this is far smaller than the
+// table, and marking it doesn't need to walk the nodes at all.
+//
+// Values are added by whoever holds FrameList::mutex, into fixed size chunks
+// which never move, so that GC can mark up to the published count without
+// taking that lock.
+class FrameValueSet {
+    static constexpr size_t CHUNK_SIZE = 1024;
+
+    struct Chunk {
+        VALUE values[CHUNK_SIZE];
+        std::atomic<Chunk *> next{NULL};
+    };
+
+    Chunk *head;
+    Chunk *tail;
+    std::atomic<size_t> count{0};
+
+    // Only used by the writer
+    std::unordered_set<VALUE> seen;
+
+    void free_chunks(Chunk *chunk) {
+        while (chunk) {
+            Chunk *next = chunk->next.load(std::memory_order_relaxed);
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    public:
+        FrameValueSet() {
+            head = tail = new Chunk();
+        }
+
+        ~FrameValueSet() {
+            free_chunks(head);
+        }
+
+        FrameValueSet(const FrameValueSet &) = delete;
+        FrameValueSet &operator=(const FrameValueSet &) = delete;
+
+        void insert(VALUE value) {
+            if (!seen.insert(value).second) return;
+
+            size_t index = count.load(std::memory_order_relaxed);
+            size_t offset = index % CHUNK_SIZE;
+            if (offset == 0 && index > 0) {
+                Chunk *chunk = new Chunk();
+                tail->next.store(chunk, std::memory_order_release);
+                tail = chunk;
+            }
+            tail->values[offset] = value;
+            count.store(index + 1, std::memory_order_release);
+        }
+
+        size_t size() const {
+            return count.load(std::memory_order_acquire);
+        }
+
+        void mark() const {
+            size_t end = size();
+            const Chunk *chunk = head;
+            for (size_t i = 0; i < end; i++) {
+                if (i > 0 && i % CHUNK_SIZE == 0) {
+                    chunk = chunk->next.load(std::memory_order_acquire);
+                }
+                rb_gc_mark(chunk->values[i % CHUNK_SIZE]);
+            }
+        }
+
+        // Only while nothing can be inserting, ie. the collector is stopped
+        void clear() {
+            free_chunks(head->next.load(std::memory_order_relaxed));
+            head->next.store(NULL, std::memory_order_relaxed);
+            tail = head;
+            count.store(0, std::memory_order_release);
+            seen.clear();
+        }
+};
+
 struct FrameList {
+    // Guards the stack table and the SampleTranslators which insert into it
+    // when they're used from outside of the GVL.
+    std::mutex mutex;
+
     std::unordered_map<std::string, int> string_to_idx;
     std::vector<std::string> string_list;
 
@@ -410,14 +915,60 @@ struct FrameList {
         return it->second;
     }
 
-    struct FrameWithInfo {
-        Frame frame;
-        FrameInfo info;
+    // There is one func for each frame VALUE, shared by all the lines we've
+    // seen in it. It's only symbolicated once, and its label and filename
+    // are interned into string_list.
+    struct FuncInfo {
+        int label_idx;
+        int file_idx;
+        int first_lineno;
     };
 
+    std::unordered_map<VALUE, int> func_to_idx;
+    std::vector<FuncInfo> func_info_list;
+    int func_index(VALUE frame) {
+#if HAVE_NATIVE_STACKS
+        if (NativeStack::is_frame(frame)) return native_func_index(frame);
+#endif
+        auto it = func_to_idx.find(frame);
+        if (it == func_to_idx.end()) {
+            int idx = func_info_list.size();
+            func_info_list.push_back(FuncInfo{
+                    string_index(FrameInfo::label_cstr(frame)),
+                    string_index(FrameInfo::file_cstr(frame)),
+                    FrameInfo::first_lineno_int(frame)
+                    });
+            auto result = func_to_idx.insert({frame, idx});
+            it = result.first;
+        }
+        return it->second;
+    }
+
+#if HAVE_NATIVE_STACKS
+    // Native funcs are keyed by their symbol (see NativeStack::Symbol), a
+    // Fixnum which can't clash with a frame VALUE
+    int native_func_index(VALUE frame) {
+        NativeStack::Symbol symbol = NativeStack::symbolicate(frame);
+        auto it = func_to_idx.find(symbol.key);
+        if (it == func_to_idx.end()) {
+            int idx = func_info_list.size();
+            func_info_list.push_back(FuncInfo{
+                    string_index(symbol.name),
+                    string_index(symbol.file),
+                    0
+                    });
+            auto result = func_to_idx.insert({symbol.key, idx});
+            it = result.first;
+        }
+        return it->second;
+    }
+#endif
+
     std::unordered_map<Frame, int> frame_to_idx;
     std::vector<Frame> frame_list;
-    std::vector<FrameWithInfo> frame_with_info_list;
+
+    // The func index of each entry in frame_list, filled in by finalize
+    std::vector<int> frame_func_list;
     int frame_index(const Frame frame) {
         auto it = frame_to_idx.find(frame);
         if (it == frame_to_idx.end()) {
@@ -429,126 +980,304 @@ struct FrameList {
         return it->second;
     }
 
+    // The stack trie is stored flat. Nodes are plain structs referring to
+    // their parent by index (-1 being the root), and a single open-addressing
+    // table maps (parent, frame, line) to the index of the child node.
     struct StackNode {
-        std::unordered_map<Frame, int> children;
-        Frame frame;
+        VALUE frame_value;
+        int line;
         int parent;
-        int index;
-
-        StackNode(Frame frame, int index, int parent) : frame(frame), index(index), parent(parent) {}
 
-        // root
-        StackNode() : frame(Frame{0, 0}), index(-1), parent(-1) {}
+        Frame frame() const {
+            return Frame{frame_value, line};
+        }
     };
 
-    StackNode root_stack_node;
+    constexpr static int ROOT_STACK_INDEX = -1;
+
     vector<StackNode> stack_node_list;
 
+    // Slots hold a stack node index, or -1 if empty. Size is a power of two.
+    vector<int> stack_node_table;
+
+    static uint64_t stack_node_hash(int parent, Frame frame) {
+        return mix_hash(frame.frame ^ mix_hash(((uint64_t)(uint32_t)parent << 32) | (uint32_t)frame.line));
+    }
+
     int stack_index(const RawSample &stack) {
         if (stack.empty()) {
             throw std::runtime_error("empty stack");
         }
 
-        StackNode *node = &root_stack_node;
+        int node = ROOT_STACK_INDEX;
         for (int i = 0; i < stack.size(); i++) {
             Frame frame = stack.frame(i);
             node = next_stack_node(node, frame);
         }
-        return node->index;
+        return node;
     }
 
-    StackNode *next_stack_node(StackNode *node, Frame frame) {
-        auto search = node->children.find(frame);
-        if (search == node->children.end()) {
-            // insert a new node
-            int next_node_idx = stack_node_list.size();
-            node->children[frame] = next_node_idx;
-            stack_node_list.emplace_back(
-                    frame,
-                    next_node_idx,
-                    node->index
-                    );
-            return &stack_node_list[next_node_idx];
-        } else {
-            int node_idx = search->second;
-            return &stack_node_list[node_idx];
+    int next_stack_node(int parent, Frame frame) {
+        // Keep the load factor at or below 1/2
+        if ((stack_node_list.size() + 1) * 2 > stack_node_table.size()) {
+            grow_stack_node_table();
+        }
+
+        size_t mask = stack_node_table.size() - 1;
+        size_t slot = stack_node_hash(parent, frame) & mask;
+        while (true) {
+            int node_idx = stack_node_table[slot];
+            if (node_idx == -1) {
+                // insert a new node
+                int next_node_idx = stack_node_list.size();
+                stack_node_list.push_back(StackNode{frame.frame, frame.line, parent});
+                if (!SPECIAL_CONST_P(frame.frame)) frame_values.insert(frame.frame);
+                stack_node_table[slot] = next_node_idx;
+                return next_node_idx;
+            }
+
+            const StackNode &node = stack_node_list[node_idx];
+            if (node.parent == parent && node.frame() == frame) {
+                return node_idx;
+            }
+
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    void grow_stack_node_table() {
+        rebuild_stack_node_table(stack_node_table.empty() ? 1024 : stack_node_table.size() * 2);
+    }
+
+    void rebuild_stack_node_table(size_t new_size) {
+        stack_node_table.assign(new_size, -1);
+
+        size_t mask = new_size - 1;
+        for (int i = 0; i < (int)stack_node_list.size(); i++) {
+            const StackNode &node = stack_node_list[i];
+            size_t slot = stack_node_hash(node.parent, node.frame()) & mask;
+            while (stack_node_table[slot] != -1) {
+                slot = (slot + 1) & mask;
+            }
+            stack_node_table[slot] = i;
+        }
+    }
+
+    // Drops the stack nodes which aren't live, or an ancestor of a live one.
+    // The rest keep their order, so parents still come before their
+    // children. Returns a mapping from old to new indexes, with -1 for nodes
+    // which were dropped. Anything holding a stack index must be remapped,
+    // and SampleTranslators reset.
+    //
+    // Must be called with mutex held
+    std::vector<int> compact_stack_nodes(std::vector<bool> &live) {
+        for (size_t i = stack_node_list.size(); i-- > 0;) {
+            int parent = stack_node_list[i].parent;
+            if (live[i] && parent != ROOT_STACK_INDEX) {
+                live[parent] = true;
+            }
+        }
+
+        std::vector<int> remap(stack_node_list.size(), -1);
+        size_t kept = 0;
+        size_t finalized = 0;
+        for (size_t i = 0; i < stack_node_list.size(); i++) {
+            if (!live[i]) continue;
+
+            StackNode node = stack_node_list[i];
+            if (node.parent != ROOT_STACK_INDEX) {
+                node.parent = remap[node.parent];
+            }
+            remap[i] = kept;
+            stack_node_list[kept++] = node;
+            if (i < finalized_stack_nodes) finalized++;
         }
+        stack_node_list.resize(kept);
+        stack_node_list.shrink_to_fit();
+        finalized_stack_nodes = finalized;
+
+        size_t table_size = 1024;
+        while (table_size < (kept + 1) * 2) table_size *= 2;
+        rebuild_stack_node_table(table_size);
+
+        return remap;
     }
 
     // Converts Frames from stacks other tables. "Symbolicates" the frames
     // which allocates.
     void finalize() {
-        for (const auto &stack_node : stack_node_list) {
-            frame_index(stack_node.frame);
-        }
-        for (const auto &frame : frame_list) {
-            frame_with_info_list.push_back(FrameWithInfo{frame, frame.info()});
+        finalize_until(TimeStamp::Zero());
+    }
+
+    // Number of stack nodes whose frames have been finalized so far
+    size_t finalized_stack_nodes = 0;
+
+    // Every frame in the stack table, including ones whose nodes were since
+    // compacted away. Those stay marked, as frame_to_idx must still be able
+    // to find them: a reused VALUE would otherwise pick up the old frame's
+    // func.
+    FrameValueSet frame_values;
+
+    // Total time spent finalizing and writing results, for meta[:profiler]
+    TimeStamp finalize_time;
+    TimeStamp write_result_time;
+
+    // Must be called with mutex held
+    bool needs_finalize() const {
+        return finalized_stack_nodes < stack_node_list.size();
+    }
+
+    // Finalizes frames of the stack nodes added since the last call, giving
+    // up once the deadline (if not zero) has passed. This may run while
+    // another thread is adding to the stack table, so we only hold the lock
+    // while copying out a batch of frames, never while symbolicating.
+    //
+    // Must hold the GVL. Returns true when everything has been finalized.
+    bool finalize_until(TimeStamp deadline) {
+        TimeStamp start = TimeStamp::Now();
+        bool done = finalize_batches(deadline);
+        finalize_time += TimeStamp::Now() - start;
+        return done;
+    }
+
+    bool finalize_batches(TimeStamp deadline) {
+        constexpr size_t BATCH_SIZE = 256;
+
+        // Kept off the machine stack, otherwise stale frames left there would
+        // be found by the conservative GC and kept alive.
+        std::vector<Frame> batch;
+        batch.reserve(BATCH_SIZE);
+
+        while (true) {
+            batch.clear();
+            {
+                const std::lock_guard<std::mutex> lock(mutex);
+                while (batch.size() < BATCH_SIZE && finalized_stack_nodes < stack_node_list.size()) {
+                    batch.push_back(stack_node_list[finalized_stack_nodes++].frame());
+                }
+            }
+
+            if (batch.empty()) {
+                return true;
+            }
+
+            for (const auto &frame : batch) {
+                frame_index(frame);
+            }
+            for (size_t i = frame_func_list.size(); i < frame_list.size(); i++) {
+                frame_func_list.push_back(func_index(frame_list[i].frame));
+            }
+
+            if (!deadline.zero() && TimeStamp::Now() > deadline) {
+                return false;
+            }
         }
     }
 
+    // Safe to call while another thread is adding to the stack table
     void mark_frames() {
-        for (auto stack_node: stack_node_list) {
-            rb_gc_mark(stack_node.frame.frame);
-        }
+        frame_values.mark();
     }
 
     void clear() {
         string_list.clear();
         frame_list.clear();
         stack_node_list.clear();
-        frame_with_info_list.clear();
+        frame_func_list.clear();
+        func_info_list.clear();
+        finalized_stack_nodes = 0;
+        frame_values.clear();
+        finalize_time = TimeStamp();
+        write_result_time = TimeStamp();
 
         string_to_idx.clear();
+        func_to_idx.clear();
         frame_to_idx.clear();
-        root_stack_node.children.clear();
+        stack_node_table.clear();
+    }
+
+    // How far into each table a result has been written
+    struct TableSizes {
+        size_t stacks = 0;
+        size_t frames = 0;
+        size_t funcs = 0;
+    };
+
+    // Writes the tables, starting from the given sizes so that a chunk only
+    // carries the entries added since the previous one. Indexes are always
+    // global. Only stack nodes which have been finalized are written. Returns
+    // the sizes written up to.
+    //
+    // Stack nodes may still be added by the sampler while this runs.
+    TableSizes write_result(VALUE result, bool packed = false) {
+        return write_result(result, packed, TableSizes());
     }
 
-    void write_result(VALUE result) {
+    TableSizes write_result(VALUE result, bool packed, const TableSizes &from) {
         FrameList &frame_list = *this;
+        TimeStamp start = TimeStamp::Now();
+
+        TableSizes to;
+        std::vector<int32_t> parents;
+        std::vector<int32_t> column;
+
+        // Copy out under the lock, but allocate Ruby objects after releasing
+        // it as the GC marking us would need it.
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            to.stacks = finalized_stack_nodes;
+            for (size_t i = from.stacks; i < to.stacks; i++) {
+                const StackNode &stack = frame_list.stack_node_list[i];
+                parents.push_back(stack.parent);
+                column.push_back(frame_list.frame_index(stack.frame()));
+            }
+        }
+        to.frames = frame_list.frame_list.size();
+        to.funcs = frame_list.func_info_list.size();
 
         VALUE stack_table = rb_hash_new();
         rb_ivar_set(result, rb_intern("@stack_table"), stack_table);
-        VALUE stack_table_parent = rb_ary_new();
-        VALUE stack_table_frame = rb_ary_new();
-        rb_hash_aset(stack_table, sym("parent"), stack_table_parent);
-        rb_hash_aset(stack_table, sym("frame"), stack_table_frame);
-        for (const auto &stack : frame_list.stack_node_list) {
-            VALUE parent_val = stack.parent == -1 ? Qnil : INT2NUM(stack.parent);
-            rb_ary_push(stack_table_parent, parent_val);
-            rb_ary_push(stack_table_frame, INT2NUM(frame_list.frame_index(stack.frame)));
-        }
+        rb_hash_aset(stack_table, sym("parent"), int_column(parents, packed, true));
+        rb_hash_aset(stack_table, sym("frame"), int_column(column, packed));
 
         VALUE frame_table = rb_hash_new();
         rb_ivar_set(result, rb_intern("@frame_table"), frame_table);
-        VALUE frame_table_func = rb_ary_new();
-        VALUE frame_table_line = rb_ary_new();
-        rb_hash_aset(frame_table, sym("func"), frame_table_func);
-        rb_hash_aset(frame_table, sym("line"), frame_table_line);
-        //for (const auto &frame : frame_list.frame_list) {
-        for (int i = 0; i < frame_list.frame_with_info_list.size(); i++) {
-            const auto &frame = frame_list.frame_with_info_list[i];
-            rb_ary_push(frame_table_func, INT2NUM(i));
-            rb_ary_push(frame_table_line, INT2NUM(frame.frame.line));
-        }
-
-        // TODO: dedup funcs before this step
+        column.assign(frame_list.frame_func_list.begin() + from.frames, frame_list.frame_func_list.begin() + to.frames);
+        rb_hash_aset(frame_table, sym("func"), int_column(column, packed));
+        column.clear();
+        for (size_t i = from.frames; i < to.frames; i++) {
+            column.push_back(frame_list.frame_list[i].line);
+        }
+        rb_hash_aset(frame_table, sym("line"), int_column(column, packed));
+
+        // Each interned string becomes one (frozen) Ruby string, shared
+        // between all the funcs which use it.
+        std::vector<VALUE> string_values(string_list.size(), Qnil);
+        auto string_value = [&](int idx) {
+            if (NIL_P(string_values[idx])) {
+                const std::string &str = string_list[idx];
+                string_values[idx] = rb_obj_freeze(rb_str_new(str.data(), str.length()));
+            }
+            return string_values[idx];
+        };
+
         VALUE func_table = rb_hash_new();
         rb_ivar_set(result, rb_intern("@func_table"), func_table);
-        VALUE func_table_name = rb_ary_new();
-        VALUE func_table_filename = rb_ary_new();
-        VALUE func_table_first_line = rb_ary_new();
+        VALUE func_table_name = rb_ary_new_capa(to.funcs - from.funcs);
+        VALUE func_table_filename = rb_ary_new_capa(to.funcs - from.funcs);
         rb_hash_aset(func_table, sym("name"), func_table_name);
         rb_hash_aset(func_table, sym("filename"), func_table_filename);
-        rb_hash_aset(func_table, sym("first_line"), func_table_first_line);
-        for (const auto &frame : frame_list.frame_with_info_list) {
-            const std::string label = frame.info.label;
-            const std::string filename = frame.info.file;
-            const int first_line = frame.info.first_lineno;
-
-            rb_ary_push(func_table_name, rb_str_new(label.c_str(), label.length()));
-            rb_ary_push(func_table_filename, rb_str_new(filename.c_str(), filename.length()));
-            rb_ary_push(func_table_first_line, INT2NUM(first_line));
+        column.clear();
+        for (size_t i = from.funcs; i < to.funcs; i++) {
+            const auto &func = frame_list.func_info_list[i];
+            rb_ary_push(func_table_name, string_value(func.label_idx));
+            rb_ary_push(func_table_filename, string_value(func.file_idx));
+            column.push_back(func.first_lineno);
         }
+        rb_hash_aset(func_table, sym("first_line"), int_column(column, packed));
+
+        write_result_time += TimeStamp::Now() - start;
+        return to;
     }
 };
 
@@ -556,14 +1285,21 @@ class SampleTranslator {
     public:
         int last_stack_index;
 
-        Frame frames[RawSample::MAX_LEN];
-        int frame_indexes[RawSample::MAX_LEN];
+        // Grown to fit the deepest stack seen, rather than max_depth, as
+        // every thread has one
+        std::vector<Frame> frames;
+        std::vector<int> frame_indexes;
         int len;
 
-        SampleTranslator() : len(0), last_stack_index(-1) {
+        SampleTranslator() : last_stack_index(-1), len(0) {
         }
 
         int translate(FrameList &frame_list, const RawSample &sample) {
+            if (frames.size() < (size_t)sample.size()) {
+                frames.resize(sample.size());
+                frame_indexes.resize(sample.size());
+            }
+
             int i = 0;
             for (; i < len && i < sample.size(); i++) {
                 if (frames[i] != sample.frame(i)) {
@@ -571,20 +1307,26 @@ class SampleTranslator {
                 }
             }
 
-            FrameList::StackNode *node = i == 0 ? &frame_list.root_stack_node : &frame_list.stack_node_list[frame_indexes[i - 1]];
+            int node = i == 0 ? FrameList::ROOT_STACK_INDEX : frame_indexes[i - 1];
 
             for (; i < sample.size(); i++) {
                 Frame frame = sample.frame(i);
                 node = frame_list.next_stack_node(node, frame);
 
                 frames[i] = frame;
-                frame_indexes[i] = node->index;
+                frame_indexes[i] = node;
             }
             len = i;
 
-            last_stack_index = node->index;
+            last_stack_index = node;
             return last_stack_index;
         }
+
+        // Forget the cached stack, after the stack table was compacted
+        void reset() {
+            len = 0;
+            last_stack_index = -1;
+        }
 };
 
 typedef uint64_t native_thread_id_t;
@@ -604,7 +1346,7 @@ static native_thread_id_t get_native_thread_id() {
 
 class Marker {
     public:
-    enum Type {
+    enum Type : uint8_t {
         MARKER_GVL_THREAD_STARTED,
         MARKER_GVL_THREAD_EXITED,
 
@@ -619,24 +1361,26 @@ class Marker {
         MARKER_THREAD_STALLED,
         MARKER_THREAD_SUSPENDED,
 
+        MARKER_PROFILER_LATE_TICK,
+        MARKER_PROFILER_SLOW_TICK,
+
         MARKER_MAX,
     };
 
     // Must match phase types from Gecko
-    enum Phase {
+    enum Phase : uint8_t {
       INSTANT,
       INTERVAL,
       INTERVAL_START,
       INTERVAL_END
     };
 
+    // Ordered to pack into 24 bytes
     Type type;
     Phase phase;
+    int stack_index = -1;
     TimeStamp timestamp;
     TimeStamp finish;
-    // VALUE ruby_thread_id;
-    //native_thread_id_t thread_id;
-    int stack_index = -1;
 
     VALUE to_array() {
         VALUE record[6] = {0};
@@ -656,22 +1400,165 @@ class Marker {
         return rb_ary_new_from_values(6, record);
     }
 };
-
+static_assert(sizeof(Marker) == 24, "Marker should stay packed");
+
+// Markers are appended by a single writer at a time, without a lock: the
+// thread itself (already holding its Thread::mutex), whichever thread holds
+// the GVL for GC markers, or the sampler for its own. They go into a list of
+// fixed size chunks, so older markers are never copied as it grows.
+//
+// Readers take read_mutex between themselves, and only ever see markers up to
+// the published count. Chunks are freed once read past, but only after the
+// writer has moved on from them. Markers are recorded when they end, so each
+// table is in order of end time.
 class MarkerTable {
-    public:
-        std::vector<Marker> list;
-        std::mutex mutex;
+    static constexpr size_t CHUNK_SIZE = 1024;
 
-        void record_interval(Marker::Type type, TimeStamp from, TimeStamp to, int stack_index = -1) {
-            const std::lock_guard<std::mutex> lock(mutex);
+    struct Chunk {
+        Marker markers[CHUNK_SIZE];
+        std::atomic<Chunk *> next{NULL};
+    };
+
+    // Owned by the writer
+    Chunk *tail;
+
+    // Owned by readers, under read_mutex. head holds the marker at
+    // head_start, and markers before consumed have been taken or evicted.
+    Chunk *head;
+    size_t head_start = 0;
+    size_t consumed = 0;
+
+    std::atomic<size_t> count{0};
+
+    void append(const Marker &marker) {
+        size_t index = count.load(std::memory_order_relaxed);
+        size_t offset = index % CHUNK_SIZE;
+        if (offset == 0 && index > 0) {
+            Chunk *chunk = new Chunk();
+            tail->next.store(chunk, std::memory_order_release);
+            tail = chunk;
+        }
+        tail->markers[offset] = marker;
+        count.store(index + 1, std::memory_order_release);
+    }
+
+    // Calls f with each unconsumed marker, until it returns false. Must hold
+    // read_mutex.
+    template <typename F>
+    void each(F f) {
+        size_t end = count.load(std::memory_order_acquire);
+        Chunk *chunk = head;
+        size_t chunk_start = head_start;
+        for (size_t i = consumed; i < end; i++) {
+            if (i - chunk_start == CHUNK_SIZE) {
+                chunk = chunk->next.load(std::memory_order_acquire);
+                chunk_start += CHUNK_SIZE;
+            }
+            if (!f(chunk->markers[i - chunk_start])) return;
+        }
+    }
+
+    // Frees the chunks before consumed which the writer is done with. Must
+    // hold read_mutex.
+    void consume(size_t until) {
+        consumed = until;
+        while (consumed - head_start >= CHUNK_SIZE) {
+            Chunk *next = head->next.load(std::memory_order_acquire);
+            if (!next) break;
+            delete head;
+            head = next;
+            head_start += CHUNK_SIZE;
+        }
+    }
+
+    public:
+        std::mutex read_mutex;
+
+        MarkerTable() {
+            head = tail = new Chunk();
+        }
+
+        ~MarkerTable() {
+            while (head) {
+                Chunk *next = head->next.load(std::memory_order_relaxed);
+                delete head;
+                head = next;
+            }
+        }
 
-            list.push_back({ type, Marker::INTERVAL, from, to, stack_index });
+        MarkerTable(const MarkerTable &) = delete;
+        MarkerTable &operator=(const MarkerTable &) = delete;
+
+        void record_interval(Marker::Type type, TimeStamp from, TimeStamp to, int stack_index = -1) {
+            append({ type, Marker::INTERVAL, stack_index, from, to });
         }
 
         void record(Marker::Type type, int stack_index = -1) {
-            const std::lock_guard<std::mutex> lock(mutex);
+            append({ type, Marker::INSTANT, stack_index, TimeStamp::Now(), TimeStamp() });
+        }
+
+        // Drops every marker recorded so far
+        void clear() {
+            const std::lock_guard<std::mutex> lock(read_mutex);
+            consume(count.load(std::memory_order_acquire));
+        }
+
+        // Moves out the markers recorded so far
+        void take(std::vector<Marker> &out) {
+            const std::lock_guard<std::mutex> lock(read_mutex);
+
+            out.clear();
+            size_t end = consumed;
+            each([&](const Marker &marker) {
+                out.push_back(marker);
+                end++;
+                return true;
+            });
+            consume(end);
+        }
 
-            list.push_back({ type, Marker::INSTANT, TimeStamp::Now(), TimeStamp(), stack_index });
+        void copy(std::vector<Marker> &out) {
+            const std::lock_guard<std::mutex> lock(read_mutex);
+
+            out.clear();
+            each([&](const Marker &marker) {
+                out.push_back(marker);
+                return true;
+            });
+        }
+
+        // Drops markers which ended before cutoff
+        void evict_before(TimeStamp cutoff) {
+            const std::lock_guard<std::mutex> lock(read_mutex);
+
+            size_t end = consumed;
+            each([&](const Marker &marker) {
+                TimeStamp marker_end = marker.phase == Marker::INTERVAL ? marker.finish : marker.timestamp;
+                if (!(marker_end < cutoff)) return false;
+                end++;
+                return true;
+            });
+            consume(end);
+        }
+
+        // As used by compaction, while every thread's lock is held so that
+        // no marker referring to a stack can be recorded
+        void mark_live_stacks(std::vector<bool> &live) {
+            const std::lock_guard<std::mutex> lock(read_mutex);
+
+            each([&](const Marker &marker) {
+                if (marker.stack_index >= 0) live[marker.stack_index] = true;
+                return true;
+            });
+        }
+
+        void remap_stacks(const std::vector<int> &remap) {
+            const std::lock_guard<std::mutex> lock(read_mutex);
+
+            each([&](Marker &marker) {
+                if (marker.stack_index >= 0) marker.stack_index = remap[marker.stack_index];
+                return true;
+            });
         }
 };
 
@@ -684,7 +1571,7 @@ class GCMarkerTable: public MarkerTable {
         }
 
         void record_gc_leave() {
-          list.push_back({ Marker::MARKER_GC_PAUSE, Marker::INTERVAL, last_gc_entry, TimeStamp::Now(), -1 });
+          record_interval(Marker::MARKER_GC_PAUSE, last_gc_entry, TimeStamp::Now());
         }
 };
 
@@ -693,65 +1580,557 @@ enum Category{
 	CATEGORY_IDLE
 };
 
+// Fixed size blocks to build SampleList columns from. Blocks given back by
+// one list (eg. as samples are evicted, or once a result is written) are
+// reused by the next one to grow, and a collector can reserve what it
+// expects to need up front. Only taken when a column needs another block.
+class SegmentPool {
+    public:
+        static constexpr size_t BLOCK_SIZE = 16 * 1024;
+
+        ~SegmentPool() {
+            trim();
+        }
+
+        void *allocate() {
+            {
+                const std::lock_guard<std::mutex> lock(mutex);
+                if (!free_blocks.empty()) {
+                    void *block = free_blocks.back();
+                    free_blocks.pop_back();
+                    return block;
+                }
+            }
+            return ::operator new(BLOCK_SIZE);
+        }
+
+        void release(void *block) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            free_blocks.push_back(block);
+        }
+
+        // Makes sure at least this many bytes of blocks are free
+        void reserve(size_t bytes) {
+            const std::lock_guard<std::mutex> lock(mutex);
+            size_t blocks = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            while (free_blocks.size() < blocks) {
+                free_blocks.push_back(::operator new(BLOCK_SIZE));
+            }
+        }
+
+        // Frees the blocks not in use
+        void trim() {
+            const std::lock_guard<std::mutex> lock(mutex);
+            for (void *block : free_blocks) {
+                ::operator delete(block);
+            }
+            free_blocks.clear();
+        }
+
+    private:
+        std::mutex mutex;
+        std::vector<void *> free_blocks;
+};
+
+// An append-only column of trivially copyable values, stored in segments of
+// one SegmentPool block each, so that growing it never copies what's already
+// there. Without a pool, blocks come straight from the heap.
+template <typename T>
+class SegmentedColumn {
+    public:
+        static constexpr size_t SEGMENT_LEN = SegmentPool::BLOCK_SIZE / sizeof(T);
+
+        SegmentedColumn(SegmentPool *pool = NULL) : pool(pool) {}
+
+        SegmentedColumn(const SegmentedColumn &other) : pool(other.pool) {
+            other.each_segment([&](const T *values, size_t count) {
+                for (size_t i = 0; i < count; i++) push_back(values[i]);
+            });
+        }
+
+        SegmentedColumn(SegmentedColumn &&other) : pool(other.pool) {
+            swap(other);
+        }
+
+        SegmentedColumn &operator=(SegmentedColumn other) {
+            swap(other);
+            return *this;
+        }
+
+        ~SegmentedColumn() {
+            clear();
+        }
+
+        void swap(SegmentedColumn &other) {
+            std::swap(segments, other.segments);
+            std::swap(start, other.start);
+            std::swap(len, other.len);
+            std::swap(pool, other.pool);
+        }
+
+        size_t size() const { return len; }
+        bool empty() const { return len == 0; }
+
+        T &operator[](size_t i) {
+            size_t pos = start + i;
+            return segments[pos / SEGMENT_LEN][pos % SEGMENT_LEN];
+        }
+
+        const T &operator[](size_t i) const {
+            size_t pos = start + i;
+            return segments[pos / SEGMENT_LEN][pos % SEGMENT_LEN];
+        }
+
+        T &back() { return (*this)[len - 1]; }
+        const T &back() const { return (*this)[len - 1]; }
+
+        void push_back(const T &value) {
+            size_t pos = start + len;
+            if (pos == segments.size() * SEGMENT_LEN) {
+                segments.push_back(static_cast<T *>(pool ? pool->allocate() : ::operator new(SegmentPool::BLOCK_SIZE)));
+            }
+            segments[pos / SEGMENT_LEN][pos % SEGMENT_LEN] = value;
+            len++;
+        }
+
+        // Drops the first count values, giving back the segments emptied
+        void erase_front(size_t count) {
+            start += count;
+            len -= count;
+            size_t emptied = start / SEGMENT_LEN;
+            for (size_t i = 0; i < emptied; i++) {
+                release(segments[i]);
+            }
+            segments.erase(segments.begin(), segments.begin() + emptied);
+            start %= SEGMENT_LEN;
+        }
+
+        void clear() {
+            for (T *segment : segments) {
+                release(segment);
+            }
+            segments.clear();
+            start = len = 0;
+        }
+
+        // Calls f(values, count) with each run of contiguous values in order
+        template <typename F>
+        void each_segment(F f) const {
+            size_t remaining = len;
+            size_t offset = start;
+            for (size_t i = 0; remaining > 0; i++) {
+                size_t count = SEGMENT_LEN - offset;
+                if (count > remaining) count = remaining;
+                f(segments[i] + offset, count);
+                remaining -= count;
+                offset = 0;
+            }
+        }
+
+    private:
+        std::vector<T *> segments;
+        size_t start = 0;
+        size_t len = 0;
+        SegmentPool *pool;
+
+        void release(T *segment) {
+            if (pool) {
+                pool->release(segment);
+            } else {
+                ::operator delete(segment);
+            }
+        }
+};
+
+// Samples are stored varint encoded, as most of what's in them is small:
+// the time since the previous sample (zigzag encoded, in case the clock
+// steps back), the stack index, and the weight and category packed into
+// one. That's typically 6 or 7 bytes rather than 28. The thread id isn't
+// stored at all, as each list only ever holds one thread's samples.
+//
+// The most recent sample is held back unencoded, so that following samples
+// of the same stack can be merged into it.
+//
+// An aggregate list keeps no timeline at all, only the total weight of each
+// stack and category, so it grows with the number of unique stacks rather
+// than with time.
 class SampleList {
     public:
+        // If not zero, samples further apart than this are never merged, so
+        // that evict_before is accurate to within it
+        TimeStamp max_merge_span;
 
-        std::vector<int> stacks;
-        std::vector<TimeStamp> timestamps;
-        std::vector<native_thread_id_t> threads;
-        std::vector<Category> categories;
-        std::vector<int> weights;
+        // Roughly what an encoded sample takes, for SegmentPool::reserve
+        static constexpr size_t BYTES_PER_SAMPLE = 8;
 
-        size_t size() {
-            return stacks.size();
+        SampleList(SegmentPool *pool = NULL) : encoded(pool), pool(pool) {
+        }
+
+        // Only while empty. Keeps how the list was configured.
+        void set_pool(SegmentPool *pool) {
+            bool aggregate = this->aggregate;
+            TimeStamp max_merge_span = this->max_merge_span;
+            *this = SampleList(pool);
+            this->aggregate = aggregate;
+            this->max_merge_span = max_merge_span;
+        }
+
+        // Only while empty
+        void set_aggregate(bool aggregate) {
+            this->aggregate = aggregate;
+        }
+
+        // Moves out the samples, leaving an empty list configured the same
+        SampleList take() {
+            SampleList taken(pool);
+            std::swap(taken, *this);
+            max_merge_span = taken.max_merge_span;
+            aggregate = taken.aggregate;
+            return taken;
+        }
+
+        size_t size() const {
+            if (aggregate) return totals.size();
+            return encoded_count + has_pending;
         }
 
-        bool empty() {
+        bool empty() const {
             return size() == 0;
         }
 
-        void record_sample(int stack_index, TimeStamp time, native_thread_id_t thread_id, Category category) {
+        void record_sample(int stack_index, TimeStamp time, Category category, int weight = 1, int label = 0) {
+            if (aggregate) {
+                auto inserted = totals_index.emplace(aggregate_key(stack_index, category, label), totals.size());
+                if (inserted.second) {
+                    totals.push_back(Sample{stack_index, TimeStamp(), category, weight, label});
+                } else {
+                    totals[inserted.first->second].weight += weight;
+                }
+                return;
+            }
+
             if (
-                    !empty() &&
-                    stacks.back() == stack_index &&
-                    threads.back() == thread_id &&
-                    categories.back() == category)
+                    has_pending &&
+                    pending.stack == stack_index &&
+                    pending.category == category &&
+                    pending.label == label &&
+                    (max_merge_span.zero() || time - pending.time < max_merge_span))
             {
                 // We don't compare timestamps for de-duplication
-                weights.back() += 1;
-            } else {
-                stacks.push_back(stack_index);
-                timestamps.push_back(time);
-                threads.push_back(thread_id);
-                categories.push_back(category);
-                weights.push_back(1);
+                pending.weight += weight;
+                return;
+            }
+
+            if (has_pending) encode(pending);
+            pending = Sample{stack_index, time, category, weight, label};
+            has_pending = true;
+        }
+
+        // Drops samples taken before cutoff. Not for aggregate lists, which
+        // don't know when their samples were taken.
+        void evict_before(TimeStamp cutoff) {
+            assert(!aggregate);
+            size_t pos = 0, dropped = 0;
+            TimeStamp time = base;
+            while (dropped < encoded_count) {
+                size_t next = pos;
+                Sample sample = decode(next, time);
+                if (!(sample.time < cutoff)) break;
+                pos = next;
+                time = sample.time;
+                dropped++;
+            }
+
+            encoded.erase_front(pos);
+            encoded_count -= dropped;
+            base = time;
+
+            if (encoded_count == 0 && has_pending && pending.time < cutoff) {
+                has_pending = false;
+            }
+        }
+
+        void mark_live_stacks(std::vector<bool> &live) const {
+            each([&](const Sample &sample) {
+                live[sample.stack] = true;
+            });
+        }
+
+        // Stack indexes are encoded, so this rewrites the whole list
+        void remap_stacks(const std::vector<int> &remap) {
+            if (aggregate) {
+                // Live stacks keep distinct indexes, so no totals collide
+                totals_index.clear();
+                for (size_t i = 0; i < totals.size(); i++) {
+                    totals[i].stack = remap[totals[i].stack];
+                    totals_index[aggregate_key(totals[i].stack, totals[i].category, totals[i].label)] = i;
+                }
+                return;
+            }
+
+            std::vector<Sample> samples;
+            samples.reserve(encoded_count);
+            each_encoded([&](const Sample &sample) {
+                samples.push_back(sample);
+            });
+
+            encoded.clear();
+            encoded_count = 0;
+            last_time = base;
+            for (Sample &sample : samples) {
+                sample.stack = remap[sample.stack];
+                encode(sample);
+            }
+            if (has_pending) pending.stack = remap[pending.stack];
+        }
+
+        // Labelled samples also get a sample_labels column, indexing into
+        // the label sets in labels (nil for unlabelled samples)
+        void write_result(VALUE result, bool packed = false) const {
+            std::vector<int32_t> stacks, weights, categories, labels;
+            std::vector<uint64_t> timestamps;
+            stacks.reserve(size());
+            weights.reserve(size());
+            categories.reserve(size());
+            timestamps.reserve(size());
+            labels.reserve(size());
+            std::unordered_map<int, int> label_index;
+            std::vector<int> label_ids;
+            each([&](const Sample &sample) {
+                stacks.push_back(sample.stack);
+                weights.push_back(sample.weight);
+                categories.push_back(sample.category);
+                if (!aggregate) timestamps.push_back(sample.time.nanoseconds());
+                if (sample.label) {
+                    auto inserted = label_index.emplace(sample.label, (int)label_ids.size());
+                    if (inserted.second) label_ids.push_back(sample.label);
+                    labels.push_back(inserted.first->second);
+                } else {
+                    labels.push_back(-1);
+                }
+            });
+
+            rb_hash_aset(result, sym("samples"), int_column(stacks, packed));
+            rb_hash_aset(result, sym("weights"), int_column(weights, packed));
+            if (!aggregate) {
+                rb_hash_aset(result, sym("timestamps"), uint64_column(timestamps, packed));
+            }
+            rb_hash_aset(result, sym("sample_categories"), int_column(categories, packed));
+
+            if (!label_ids.empty()) {
+                VALUE label_sets = rb_ary_new_capa(label_ids.size());
+                for (int id : label_ids) {
+                    rb_ary_push(label_sets, LabelTable::instance().to_hash(id));
+                }
+                rb_hash_aset(result, sym("sample_labels"), int_column(labels, packed, true));
+                rb_hash_aset(result, sym("labels"), label_sets);
+            }
+        }
+
+    private:
+        struct Sample {
+            int stack;
+            TimeStamp time;
+            Category category;
+            int weight;
+            int label;
+        };
+
+        SegmentedColumn<uint8_t> encoded;
+        size_t encoded_count = 0;
+
+        // The time of the sample before the first encoded one, and of the
+        // last encoded one
+        TimeStamp base;
+        TimeStamp last_time;
+
+        Sample pending;
+        bool has_pending = false;
+
+        SegmentPool *pool;
+
+        // An aggregate list's totals, in the order their stacks were first
+        // seen, and where each stack and category's is
+        bool aggregate = false;
+        std::vector<Sample> totals;
+        std::unordered_map<uint64_t, size_t> totals_index;
+
+        static uint64_t aggregate_key(int stack_index, Category category, int label) {
+            return ((uint64_t)(uint32_t)stack_index << 32) | ((uint64_t)(uint32_t)label << 1) | (category == CATEGORY_IDLE);
+        }
+
+        void write_varint(uint64_t value) {
+            while (value >= 0x80) {
+                encoded.push_back((uint8_t)(value | 0x80));
+                value >>= 7;
+            }
+            encoded.push_back((uint8_t)value);
+        }
+
+        uint64_t read_varint(size_t &pos) const {
+            uint64_t value = 0;
+            for (int shift = 0;; shift += 7) {
+                uint8_t byte = encoded[pos++];
+                value |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+        }
+
+        void encode(const Sample &sample) {
+            int64_t delta = (int64_t)(sample.time.nanoseconds() - last_time.nanoseconds());
+            write_varint(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+            write_varint((uint32_t)sample.stack);
+            write_varint(((uint64_t)(uint32_t)sample.weight << 1) | (sample.category == CATEGORY_IDLE));
+            write_varint((uint32_t)sample.label);
+            last_time = sample.time;
+            encoded_count++;
+        }
+
+        // Decodes the sample at pos, which follows one taken at time
+        Sample decode(size_t &pos, TimeStamp time) const {
+            uint64_t zigzag = read_varint(pos);
+            int64_t delta = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            Sample sample;
+            sample.time = TimeStamp::from_nanoseconds(time.nanoseconds() + delta);
+            sample.stack = (int)read_varint(pos);
+            uint64_t weight_category = read_varint(pos);
+            sample.weight = (int)(weight_category >> 1);
+            sample.category = (weight_category & 1) ? CATEGORY_IDLE : CATEGORY_NORMAL;
+            sample.label = (int)read_varint(pos);
+            return sample;
+        }
+
+        template <typename F>
+        void each_encoded(F f) const {
+            size_t pos = 0;
+            TimeStamp time = base;
+            for (size_t i = 0; i < encoded_count; i++) {
+                Sample sample = decode(pos, time);
+                time = sample.time;
+                f(sample);
+            }
+        }
+
+        template <typename F>
+        void each(F f) const {
+            if (aggregate) {
+                for (const Sample &sample : totals) f(sample);
+                return;
+            }
+            each_encoded(f);
+            if (has_pending) f(pending);
+        }
+};
+
+// How long a thread waited for the GVL each time it got it back, and how
+// long it had been suspended beforehand, totalled by the stack it resumed at
+// (-1 where that isn't known) and as log2 histograms: bucket i counts the
+// waits of at least 2^i ns and under 2^(i+1) ns (with 0 in bucket 0).
+class GvlStats {
+    public:
+        static constexpr int BUCKETS = 64;
+
+        struct StackTimes {
+            uint64_t stalled_ns = 0;
+            uint64_t suspended_ns = 0;
+            uint64_t stalls = 0;
+            uint64_t suspensions = 0;
+        };
+
+        GvlStats() : stall_histogram(BUCKETS), suspend_histogram(BUCKETS) {
+        }
+
+        // A zero suspended means the thread wasn't suspended, only stalled
+        // (eg. after being preempted)
+        void record(int stack_idx, TimeStamp stalled, TimeStamp suspended) {
+            StackTimes &times = by_stack[stack_idx];
+            times.stalled_ns += stalled.nanoseconds();
+            times.stalls++;
+            stall_histogram[bucket(stalled)]++;
+
+            if (!suspended.zero()) {
+                times.suspended_ns += suspended.nanoseconds();
+                times.suspensions++;
+                suspend_histogram[bucket(suspended)]++;
             }
         }
 
-        void write_result(VALUE result) const {
-            VALUE samples = rb_ary_new();
-            rb_hash_aset(result, sym("samples"), samples);
-            for (auto& stack_index: this->stacks) {
-                rb_ary_push(samples, INT2NUM(stack_index));
+        bool empty() const {
+            return by_stack.empty();
+        }
+
+        // Moves out the totals, leaving them empty
+        GvlStats take() {
+            GvlStats taken;
+            std::swap(taken, *this);
+            return taken;
+        }
+
+        void mark_live_stacks(std::vector<bool> &live) const {
+            for (auto &pair : by_stack) {
+                if (pair.first >= 0) live[pair.first] = true;
             }
+        }
 
-            VALUE weights = rb_ary_new();
-            rb_hash_aset(result, sym("weights"), weights);
-            for (auto& weight: this->weights) {
-                rb_ary_push(weights, INT2NUM(weight));
+        // Live stacks keep distinct indexes, so no totals collide
+        void remap_stacks(const std::vector<int> &remap) {
+            std::unordered_map<int, StackTimes> remapped;
+            for (auto &pair : by_stack) {
+                remapped[pair.first >= 0 ? remap[pair.first] : -1] = pair.second;
             }
+            by_stack.swap(remapped);
+        }
 
-            VALUE timestamps = rb_ary_new();
-            rb_hash_aset(result, sym("timestamps"), timestamps);
-            for (auto& timestamp: this->timestamps) {
-                rb_ary_push(timestamps, ULL2NUM(timestamp.nanoseconds()));
+        // Stacks which stalled the longest come first, and histograms stop
+        // at their last non-empty bucket
+        void write_result(VALUE hash) const {
+            std::vector<std::pair<int, StackTimes>> rows(by_stack.begin(), by_stack.end());
+            std::sort(rows.begin(), rows.end(), [](const std::pair<int, StackTimes> &a, const std::pair<int, StackTimes> &b) {
+                if (a.second.stalled_ns != b.second.stalled_ns) return a.second.stalled_ns > b.second.stalled_ns;
+                return a.first < b.first;
+            });
+
+            VALUE stacks = rb_ary_new_capa(rows.size());
+            VALUE stalled_ns = rb_ary_new_capa(rows.size());
+            VALUE suspended_ns = rb_ary_new_capa(rows.size());
+            VALUE stalls = rb_ary_new_capa(rows.size());
+            VALUE suspensions = rb_ary_new_capa(rows.size());
+            for (auto &row : rows) {
+                rb_ary_push(stacks, row.first >= 0 ? INT2NUM(row.first) : Qnil);
+                rb_ary_push(stalled_ns, ULL2NUM(row.second.stalled_ns));
+                rb_ary_push(suspended_ns, ULL2NUM(row.second.suspended_ns));
+                rb_ary_push(stalls, ULL2NUM(row.second.stalls));
+                rb_ary_push(suspensions, ULL2NUM(row.second.suspensions));
             }
 
-            VALUE sample_categories = rb_ary_new();
-            rb_hash_aset(result, sym("sample_categories"), sample_categories);
-            for (auto& cat: this->categories) {
-                rb_ary_push(sample_categories, INT2NUM(cat));
+            rb_hash_aset(hash, sym("stack"), stacks);
+            rb_hash_aset(hash, sym("stalled_ns"), stalled_ns);
+            rb_hash_aset(hash, sym("suspended_ns"), suspended_ns);
+            rb_hash_aset(hash, sym("stalls"), stalls);
+            rb_hash_aset(hash, sym("suspensions"), suspensions);
+            rb_hash_aset(hash, sym("stall_histogram"), histogram_ary(stall_histogram));
+            rb_hash_aset(hash, sym("suspend_histogram"), histogram_ary(suspend_histogram));
+        }
+
+    private:
+        std::unordered_map<int, StackTimes> by_stack;
+        std::vector<uint64_t> stall_histogram;
+        std::vector<uint64_t> suspend_histogram;
+
+        static int bucket(TimeStamp duration) {
+            uint64_t ns = duration.nanoseconds();
+            return ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+        }
+
+        static VALUE histogram_ary(const std::vector<uint64_t> &histogram) {
+            size_t len = histogram.size();
+            while (len > 0 && histogram[len - 1] == 0) len--;
+
+            VALUE ary = rb_ary_new_capa(len);
+            for (size_t i = 0; i < len; i++) {
+                rb_ary_push(ary, ULL2NUM(histogram[i]));
             }
+            return ary;
         }
 };
 
@@ -771,31 +2150,80 @@ class Thread {
         VALUE ruby_thread_id;
         pthread_t pthread_id;
         native_thread_id_t native_tid;
-        State state;
+
+        // Written by the thread's own GVL events while holding mutex. The
+        // sampler may peek at it without the lock to skip idle threads.
+        std::atomic<State> state;
+
+        // Guards state transitions, and is held by the sampler while it takes
+        // a sample of this thread. GVL events only ever contend on the lock of
+        // their own thread.
+        std::mutex mutex;
 
         TimeStamp state_changed_at;
         TimeStamp started_at;
         TimeStamp stopped_at;
 
         int stack_on_suspend_idx;
+
+        // Set when the thread suspended but we haven't yet captured the
+        // stack it suspended with. See ThreadTable::set_state.
+        std::atomic<bool> stack_on_suspend_pending{false};
+
+        // The thread's label when it suspended, which its idle samples get
+        int label_on_suspend = 0;
+
+        // Rather than the sampler recording every suspended thread on every
+        // tick, each suspension is recorded once, weighted by the ticks
+        // which started during it (ThreadTable::tick_weight counts them).
+        // Only the sampler writes samples, so finished suspensions wait here
+        // until it next holds our lock. See TimeCollector::record_idle.
+        struct Suspension {
+            TimeStamp from;
+            int stack_idx;
+            int label;
+            uint64_t weight;
+        };
+        std::vector<Suspension> suspensions;
+
+        // A finished suspension which a tick landed in, but whose stack
+        // nothing captured while it lasted. Its weight is zero if there's
+        // none. Once the thread has the GVL back it walks its own stack,
+        // which is still the one it suspended with.
+        Suspension uncaptured_suspension = {};
+
+        // Since when, and from what tick weight, the current suspension
+        // hasn't been recorded
+        TimeStamp idle_since;
+        uint64_t idle_since_tick_weight = 0;
+
+        GvlStats gvl;
+
+        // While READY, how long the thread was suspended beforehand and
+        // where, for gvl once it runs again
+        TimeStamp gvl_suspended;
+        int gvl_stack_idx = -1;
+
+        // Scratch space for walking the stack the thread resumes with, see
+        // ThreadTable::gvl_stacks
+        std::unique_ptr<RawSample> resume_sample;
+
         SampleTranslator translator;
 
-        MarkerTable *markers;
+        MarkerTable markers;
 
 	std::string name;
 
 	// FIXME: don't use pthread at start
-        Thread(State state, pthread_t pthread_id, VALUE ruby_thread) : pthread_id(pthread_id), ruby_thread(ruby_thread), state(state), stack_on_suspend_idx(-1) {
+        Thread(State state, pthread_t pthread_id, VALUE ruby_thread) : ruby_thread(ruby_thread), pthread_id(pthread_id), state(state), stack_on_suspend_idx(-1) {
             name = Qnil;
-            ruby_thread_id = rb_obj_id(ruby_thread);
-	    //ruby_thread_id = ULL2NUM(ruby_thread);
+            ruby_thread_id = Qnil;
             native_tid = get_native_thread_id();
             started_at = state_changed_at = TimeStamp::Now();
             name = "";
-            markers = new MarkerTable();
 
             if (state == State::STARTED) {
-                markers->record(Marker::Type::MARKER_GVL_THREAD_STARTED);
+                markers.record(Marker::Type::MARKER_GVL_THREAD_STARTED);
             }
         }
 
@@ -817,7 +2245,7 @@ class Thread {
 
             switch (new_state) {
                 case State::STARTED:
-                    markers->record(Marker::Type::MARKER_GVL_THREAD_STARTED);
+                    markers.record(Marker::Type::MARKER_GVL_THREAD_STARTED);
                     return; // no mutation of current state
                     break;
                 case State::RUNNING:
@@ -828,7 +2256,7 @@ class Thread {
                     // If the GVL is immediately ready, and we measure no times
                     // stalled, skip emitting the interval.
                     if (from != now) {
-                        markers->record_interval(Marker::Type::MARKER_THREAD_STALLED, from, now);
+                        markers.record_interval(Marker::Type::MARKER_THREAD_STALLED, from, now);
                     }
                     break;
                 case State::READY:
@@ -841,22 +2269,22 @@ class Thread {
                     // so I'll put you in the 'ready' (or stalled) state"
                     assert(state == State::STARTED || state == State::SUSPENDED || state == State::RUNNING);
                     if (state == State::SUSPENDED) {
-                        markers->record_interval(Marker::Type::MARKER_THREAD_SUSPENDED, from, now, stack_on_suspend_idx);
+                        markers.record_interval(Marker::Type::MARKER_THREAD_SUSPENDED, from, now, stack_on_suspend_idx);
                     }
                     else if (state == State::RUNNING) {
-                        markers->record_interval(Marker::Type::MARKER_THREAD_RUNNING, from, now);
+                        markers.record_interval(Marker::Type::MARKER_THREAD_RUNNING, from, now);
                     }
                     break;
                 case State::SUSPENDED:
                     // We can go from RUNNING or STARTED to SUSPENDED
                     assert(state == State::RUNNING || state == State::STARTED || state == State::SUSPENDED);
-                    markers->record_interval(Marker::Type::MARKER_THREAD_RUNNING, from, now);
+                    markers.record_interval(Marker::Type::MARKER_THREAD_RUNNING, from, now);
                     break;
                 case State::STOPPED:
                     // We can go from RUNNING or STARTED or SUSPENDED to STOPPED
                     assert(state == State::RUNNING || state == State::STARTED || state == State::SUSPENDED);
-                    markers->record_interval(Marker::Type::MARKER_THREAD_RUNNING, from, now);
-                    markers->record(Marker::Type::MARKER_GVL_THREAD_EXITED);
+                    markers.record_interval(Marker::Type::MARKER_THREAD_RUNNING, from, now);
+                    markers.record(Marker::Type::MARKER_GVL_THREAD_EXITED);
 
                     stopped_at = now;
                     capture_name();
@@ -879,7 +2307,22 @@ class Thread {
             //    name = std::string(buf);
         }
 
+        // The thread's object id, looked up the first time a result needs
+        // it. Threads can be created by GVL events which don't hold the GVL,
+        // and with the table lock held, where we mustn't allocate. Must hold
+        // the GVL.
+        VALUE object_id() {
+            if (NIL_P(ruby_thread_id)) {
+                ruby_thread_id = rb_obj_id(ruby_thread);
+            }
+            return ruby_thread_id;
+        }
+
+        // Keeps the VALUE from being reused while we're in the table, where
+        // it's our key
         void mark() {
+            rb_gc_mark(ruby_thread);
+            rb_gc_mark(ruby_thread_id);
         }
 };
 
@@ -887,15 +2330,66 @@ class ThreadTable {
     public:
         FrameList &frame_list;
 
-        std::vector<Thread> list;
+        // Threads are stored behind a pointer so that queued samples can refer
+        // to them, and are only removed by remove_stopped_before
+        std::vector<std::unique_ptr<Thread>> list;
+        std::unordered_map<VALUE, Thread *> thread_map;
+
+        // Only guards list and thread_map. Each Thread has its own lock for
+        // its state.
         std::mutex mutex;
 
-        ThreadTable(FrameList &frame_list) : frame_list(frame_list) {
+        // Given to the SampleList of each new thread
+        TimeStamp max_merge_span;
+        SegmentPool *sample_pool = NULL;
+        bool aggregate = false;
+
+        // Whether each thread's stack is walked whenever it gets the GVL
+        // back, so that every wait can be put down to a stack in its
+        // GvlStats. Otherwise only waits after a suspension which the
+        // sampler caught are, as the thread resumes where it suspended.
+        bool gvl_stacks = false;
+
+        // Each thread's stack bounds are found when it runs, so that its
+        // native stack can be walked
+        bool native = false;
+
+        int max_depth = RawSample::DEFAULT_MAX_DEPTH;
+
+        // The total weight of every tick so far, which suspended threads
+        // measure their idle time in
+        std::atomic<uint64_t> tick_weight{0};
+
+        // How long GVL hooks and the sampler have waited for the table lock
+        std::atomic<uint64_t> lock_wait_ns{0};
+        std::atomic<uint64_t> lock_contended{0};
+
+        ThreadTable(FrameList &frame_list) : frame_list(frame_list), table_id(next_table_id++) {
         }
 
+        // GVL events add threads without holding the GVL, so this needs the
+        // lock too. Nothing allocates Ruby objects while holding it, so GC
+        // can't start from inside it.
         void mark() {
+            std::unique_lock<std::mutex> lock = lock_table();
+            for (auto &thread : list) {
+                thread->mark();
+            }
+        }
+
+        size_t size() {
+            std::unique_lock<std::mutex> lock = lock_table();
+            return list.size();
+        }
+
+        // Copy the current list of threads so that the sampler can walk it
+        // without holding the table lock
+        void snapshot(std::vector<Thread *> &threads) {
+            std::unique_lock<std::mutex> lock = lock_table();
+
+            threads.clear();
             for (auto &thread : list) {
-                thread.mark();
+                threads.push_back(thread.get());
             }
         }
 
@@ -920,65 +2414,263 @@ class ThreadTable {
             set_state(Thread::State::STOPPED, th);
         }
 
-    private:
-        void set_state(Thread::State new_state, VALUE th) {
-            const std::lock_guard<std::mutex> lock(mutex);
-
-            //cerr << "set state=" << new_state << " thread=" << gettid() << endl;
+        // In a forked child, where only the forking thread survives. Every
+        // Thread is dropped along with what it recorded. Another thread may
+        // have held the table lock at the fork, so it's replaced too.
+        void after_fork() {
+            new (&mutex) std::mutex();
+            list.clear();
+            thread_map.clear();
+            table_id = next_table_id++;
+        }
 
-            pid_t native_tid = get_native_thread_id();
-            pthread_t pthread_id = pthread_self();
+        // Frees the threads which stopped before the given time, along with
+        // everything they recorded. Must hold the GVL, so that nothing is
+        // marking or building a result, and keep ticks from running, as the
+        // sampler walks Threads without the table lock.
+        void remove_stopped_before(TimeStamp before) {
+            std::unique_lock<std::mutex> lock = lock_table();
+
+            auto removed = [&](std::unique_ptr<Thread> &thread) {
+                TimeStamp stopped_at;
+                {
+                    const std::lock_guard<std::mutex> thread_lock(thread->mutex);
+                    stopped_at = thread->stopped_at;
+                }
+                if (stopped_at.zero() || !(stopped_at < before)) return false;
 
-            //fprintf(stderr, "th %p (tid: %i) from %s to %s\n", (void *)th, native_tid, gvl_event_name(state), gvl_event_name(new_state));
+                // A stopped thread's VALUE may have been reused by a new thread
+                auto it = thread_map.find(thread->ruby_thread);
+                if (it != thread_map.end() && it->second == thread.get()) {
+                    thread_map.erase(it);
+                }
+                return true;
+            };
 
-            for (auto &thread : list) {
-                if (thread_equal(th, thread.ruby_thread)) {
-                    if (new_state == Thread::State::SUSPENDED) {
+            size_t size = list.size();
+            list.erase(std::remove_if(list.begin(), list.end(), removed), list.end());
 
-                        RawSample sample;
-                        sample.sample();
+            // Lookups cached by other native threads may point at what we freed
+            if (list.size() != size) {
+                table_id = next_table_id++;
+            }
+        }
 
-                        thread.stack_on_suspend_idx = thread.translator.translate(frame_list, sample);
-                        //cerr << gettid() << " suspended! Stack size:" << thread.stack_on_suspend.size() << endl;
-                    }
+    private:
+        // Identifies this table in the per native thread lookup cache, so that
+        // a cached entry can't be mistaken for one from an older table, or
+        // for a thread since removed
+        std::atomic<uint64_t> table_id;
+        static std::atomic<uint64_t> next_table_id;
+
+        // GVL events for a Ruby thread almost always arrive on the same native
+        // thread, so remembering the last lookup lets us skip the table lock.
+        struct CachedThread {
+            uint64_t table_id;
+            VALUE ruby_thread;
+            Thread *thread;
+        };
+        static thread_local CachedThread cached_thread;
+
+        // Only timed when contended, so the common case stays a single
+        // uncontended lock
+        std::unique_lock<std::mutex> lock_table() {
+            std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+            if (!lock.owns_lock()) {
+                TimeStamp before = TimeStamp::Now();
+                lock.lock();
+                lock_wait_ns.fetch_add((TimeStamp::Now() - before).nanoseconds(), std::memory_order_relaxed);
+                lock_contended.fetch_add(1, std::memory_order_relaxed);
+            }
+            return lock;
+        }
 
-                    thread.set_state(new_state);
+        // Returns the Thread for th, or NULL if a new one was created. New
+        // threads start out in new_state so there's no transition to apply.
+        Thread *find_or_create(Thread::State new_state, VALUE th) {
+            CachedThread &cached = cached_thread;
+            if (cached.table_id == table_id && cached.ruby_thread == th && cached.thread->state != Thread::State::STOPPED) {
+                return cached.thread;
+            }
 
-                    if (thread.state == Thread::State::RUNNING) {
-                        thread.pthread_id = pthread_self();
-                        thread.native_tid = get_native_thread_id();
-                    } else {
-                        thread.pthread_id = 0;
-                        thread.native_tid = 0;
-                    }
+            std::unique_lock<std::mutex> lock = lock_table();
 
+            auto it = thread_map.find(th);
+            if (it != thread_map.end()) {
+                Thread *thread = it->second;
 
-                    return;
+                // A stopped thread's VALUE may have been reused by a new thread
+                if (!(thread->state == Thread::State::STOPPED && new_state == Thread::State::STARTED)) {
+                    cached = CachedThread{table_id, th, thread};
+                    return thread;
                 }
             }
 
+            // Both THREAD_END and EXITED stop a thread, and the second of
+            // them may come after the thread has already been removed
+            if (new_state == Thread::State::STOPPED) {
+                return NULL;
+            }
+
             //fprintf(stderr, "NEW THREAD: th: %p, state: %i\n", th, new_state);
-            list.emplace_back(new_state, pthread_self(), th);
+            Thread *thread = new Thread(new_state, pthread_self(), th);
+            thread->samples.max_merge_span = max_merge_span;
+            thread->samples.set_pool(sample_pool);
+            thread->samples.set_aggregate(aggregate);
+            list.emplace_back(thread);
+            thread_map[th] = thread;
+            cached = CachedThread{table_id, th, thread};
+            return NULL;
         }
 
-        bool thread_equal(VALUE a, VALUE b) {
-            return a == b;
+        // Walks the stack of the thread, which has just got the GVL back and
+        // is the current one. Caller holds its lock.
+        int resumed_stack(Thread &thread) {
+            if (!thread.resume_sample) {
+                thread.resume_sample.reset(new RawSample(max_depth));
+            }
+            RawSample &sample = *thread.resume_sample;
+            sample.sample();
+            if (sample.empty()) return -1;
+
+            const std::lock_guard<std::mutex> frame_lock(frame_list.mutex);
+            return thread.translator.translate(frame_list, sample);
         }
-};
 
-class BaseCollector {
-    protected:
+        void set_state(Thread::State new_state, VALUE th) {
+            //cerr << "set state=" << new_state << " thread=" << gettid() << endl;
 
-    virtual void reset() {
-        frame_list.clear();
-    }
+            Thread *thread_ptr = find_or_create(new_state, th);
+            if (!thread_ptr) return;
 
-    public:
-    bool running = false;
+            Thread &thread = *thread_ptr;
+            const std::lock_guard<std::mutex> lock(thread.mutex);
+
+            //fprintf(stderr, "th %p (tid: %i) from %s to %s\n", (void *)th, native_tid, gvl_event_name(state), gvl_event_name(new_state));
+
+            if (new_state == Thread::State::SUSPENDED && thread.state != Thread::State::SUSPENDED) {
+                // GVL events run on the thread itself
+                thread.label_on_suspend = current_label_id;
+
+#if HAVE_RB_PROFILE_THREAD_FRAMES
+                // Walking the stack on every GVL release is expensive for IO
+                // heavy threads. Instead it's only walked for suspensions a
+                // tick lands in, once we have the GVL back, or by a result
+                // built while we're still suspended (see
+                // TimeCollector::capture_suspended_stack).
+                thread.stack_on_suspend_idx = -1;
+                thread.stack_on_suspend_pending = true;
+#else
+                RawSample sample(max_depth);
+                sample.sample();
+
+                const std::lock_guard<std::mutex> frame_lock(frame_list.mutex);
+                thread.stack_on_suspend_idx = thread.translator.translate(frame_list, sample);
+                //cerr << gettid() << " suspended! Stack size:" << thread.stack_on_suspend.size() << endl;
+#endif
+            }
+
+            Thread::State old_state = thread.state;
+            bool was_suspended = old_state == Thread::State::SUSPENDED;
+            TimeStamp from = thread.state_changed_at;
+            thread.set_state(new_state);
+
+            if (old_state != Thread::State::READY && thread.state == Thread::State::READY) {
+                if (was_suspended) {
+                    thread.gvl_suspended = thread.state_changed_at - from;
+                    thread.gvl_stack_idx = thread.stack_on_suspend_idx;
+                } else {
+                    thread.gvl_suspended = TimeStamp();
+                    thread.gvl_stack_idx = -1;
+                }
+            } else if (old_state == Thread::State::READY && thread.state == Thread::State::RUNNING) {
+                Thread::Suspension &uncaptured = thread.uncaptured_suspension;
+                int resumed_idx = -1;
+                if (gvl_stacks || uncaptured.weight > 0) {
+                    resumed_idx = resumed_stack(thread);
+                }
+                if (uncaptured.weight > 0) {
+                    if (resumed_idx >= 0) {
+                        uncaptured.stack_idx = resumed_idx;
+                        thread.suspensions.push_back(uncaptured);
+                    }
+                    thread.gvl_stack_idx = resumed_idx;
+                    uncaptured = Thread::Suspension();
+                }
+
+                int stack_idx = gvl_stacks ? resumed_idx : thread.gvl_stack_idx;
+                thread.gvl.record(stack_idx, thread.state_changed_at - from, thread.gvl_suspended);
+            }
+
+            if (!was_suspended && thread.state == Thread::State::SUSPENDED) {
+                thread.idle_since = thread.state_changed_at;
+                thread.idle_since_tick_weight = tick_weight;
+            } else if (was_suspended && thread.state != Thread::State::SUSPENDED) {
+                uint64_t weight = tick_weight - thread.idle_since_tick_weight;
+                if (weight > 0 && thread.stack_on_suspend_idx >= 0) {
+                    thread.suspensions.push_back(Thread::Suspension{thread.idle_since, thread.stack_on_suspend_idx, thread.label_on_suspend, weight});
+                } else if (weight > 0 && thread.stack_on_suspend_pending) {
+                    thread.uncaptured_suspension = Thread::Suspension{thread.idle_since, -1, thread.label_on_suspend, weight};
+                }
+                thread.stack_on_suspend_pending = false;
+            }
+
+            if (thread.state == Thread::State::RUNNING) {
+                // The sampler only signals running threads
+                prepare_thread_locals();
+                thread.pthread_id = pthread_self();
+                thread.native_tid = get_native_thread_id();
+#if HAVE_NATIVE_STACKS
+                if (native) NativeStack::prepare_current_thread();
+#endif
+            } else {
+                thread.pthread_id = 0;
+                thread.native_tid = 0;
+            }
+
+            // So that our next event can't find the thread through the cache
+            // once it has been removed
+            if (thread.state == Thread::State::STOPPED && cached_thread.thread == thread_ptr) {
+                cached_thread = CachedThread();
+            }
+        }
+};
+std::atomic<uint64_t> ThreadTable::next_table_id{1};
+thread_local ThreadTable::CachedThread ThreadTable::cached_thread;
+
+class BaseCollector {
+    protected:
+
+    virtual void reset() {
+        frame_list.clear();
+        sample_pool.trim();
+    }
+
+    public:
+    bool running = false;
     FrameList frame_list;
 
+    // Write result columns as binary Strings rather than Arrays
+    bool packed = false;
+
+    // Keep only each stack's total weight rather than every sample, see
+    // SampleList. Must be set before starting.
+    bool aggregate = false;
+
+    // Take native frames along with the Ruby ones, see NativeStack. Only
+    // supported by the wall and cpu collectors, and must be set before
+    // starting.
+    bool native = false;
+
     TimeStamp started_at;
 
+    // Frames kept from the leaf end of each stack
+    const int max_depth;
+
+    // Where the collector's SampleLists get their storage
+    SegmentPool sample_pool;
+
+    BaseCollector(int max_depth) : max_depth(max_depth) {}
     virtual ~BaseCollector() {}
 
     virtual bool start() {
@@ -1001,19 +2693,49 @@ class BaseCollector {
         return Qnil;
     }
 
+    // Called once the tables have been written, so that meta[:profiler]
+    // includes the cost of writing them
     void write_meta(VALUE result) {
         VALUE meta = rb_hash_new();
         rb_ivar_set(result, rb_intern("@meta"), meta);
         rb_hash_aset(meta, sym("started_at"), ULL2NUM(started_at.nanoseconds()));
 
+        VALUE stats = rb_hash_new();
+        rb_hash_aset(meta, sym("profiler"), stats);
+        write_profiler_stats(stats);
     }
 
-    virtual VALUE build_collector_result() {
-        VALUE result = rb_obj_alloc(rb_cVernierResult);
+    // The profiler's own overhead since it started. Times are in
+    // nanoseconds.
+    virtual void write_profiler_stats(VALUE stats) {
+        size_t stack_nodes, stack_table_capacity;
+        {
+            const std::lock_guard<std::mutex> lock(frame_list.mutex);
+            stack_nodes = frame_list.stack_node_list.size();
+            stack_table_capacity = frame_list.stack_node_table.size();
+        }
+        rb_hash_aset(stats, sym("stack_nodes"), SIZET2NUM(stack_nodes));
+        rb_hash_aset(stats, sym("stack_table_capacity"), SIZET2NUM(stack_table_capacity));
+        rb_hash_aset(stats, sym("frames"), SIZET2NUM(frame_list.frame_list.size()));
+        rb_hash_aset(stats, sym("funcs"), SIZET2NUM(frame_list.func_info_list.size()));
+        rb_hash_aset(stats, sym("marked_frames"), SIZET2NUM(frame_list.frame_values.size()));
+        rb_hash_aset(stats, sym("finalize_ns"), ULL2NUM(frame_list.finalize_time.nanoseconds()));
+        rb_hash_aset(stats, sym("write_result_ns"), ULL2NUM(frame_list.write_result_time.nanoseconds()));
+    }
 
-        write_meta(result);
+    // Called around fork, see Vernier::ForkHooks. Collectors with
+    // background threads make sure none of them hold a lock across the fork,
+    // and in the child, where those threads are gone, drop what the parent
+    // recorded and start collecting afresh. Returns whether it did.
+    virtual void prepare_fork() {
+    }
 
-        return result;
+    virtual bool after_fork(bool) {
+        return false;
+    }
+
+    virtual VALUE build_collector_result() {
+        return rb_obj_alloc(rb_cVernierResult);
     }
 
     virtual void sample() {
@@ -1027,18 +2749,38 @@ class BaseCollector {
     virtual VALUE get_markers() {
         return rb_ary_new();
     };
+
+    virtual VALUE flush() {
+        rb_raise(rb_eRuntimeError, "collector doesn't support flushing");
+    };
+
+    virtual VALUE dump() {
+        rb_raise(rb_eRuntimeError, "collector doesn't support dumping");
+    };
 };
 
 class CustomCollector : public BaseCollector {
     SampleList samples;
+    RawSample raw_sample;
+
+    public:
+    CustomCollector(int max_depth) : BaseCollector(max_depth), samples(&sample_pool), raw_sample(max_depth) {}
+
+    bool start() {
+        if (!BaseCollector::start()) {
+            return false;
+        }
+        samples.set_aggregate(aggregate);
+        return true;
+    }
 
+    private:
     void sample() {
-        RawSample sample;
+        RawSample &sample = raw_sample;
         sample.sample();
         int stack_index = frame_list.stack_index(sample);
 
-	native_thread_id_t thread_id = 0;
-        samples.record_sample(stack_index, TimeStamp::Now(), thread_id, CATEGORY_NORMAL);
+        samples.record_sample(stack_index, TimeStamp::Now(), CATEGORY_NORMAL, 1, current_label_id);
     }
 
     VALUE stop() {
@@ -1060,36 +2802,167 @@ class CustomCollector : public BaseCollector {
         rb_ivar_set(result, rb_intern("@threads"), threads);
 
 	VALUE thread_hash = rb_hash_new();
-	samples.write_result(thread_hash);
+	samples.write_result(thread_hash, packed);
 
 	rb_hash_aset(threads, ULL2NUM(0), thread_hash);
 	rb_hash_aset(thread_hash, sym("tid"), ULL2NUM(0));
+        rb_hash_aset(thread_hash, sym("name"), rb_str_new_cstr(""));
+        rb_hash_aset(thread_hash, sym("started_at"), ULL2NUM(started_at.nanoseconds()));
 
-        frame_list.write_result(result);
+        frame_list.write_result(result, packed);
+        write_meta(result);
 
         return result;
     }
 };
 
+// The objects allocated while a RetainedCollector runs which haven't been
+// freed yet, with the stack each was allocated at. Entries are kept in
+// allocation order, with freed ones left as holes until there are as many
+// holes as live objects, at which point they're compacted away. An
+// open-addressing index (with tombstones for freed objects) finds an
+// object's entry. Memory use is proportional to the number of live objects.
+class ObjectTable {
+    struct Entry {
+        VALUE obj; // 0 once freed
+        int stack_index;
+    };
+
+    std::vector<Entry> entries;
+    size_t live = 0;
+
+    // Each slot is an index into entries, or one of these
+    enum : int32_t {
+        EMPTY = -1,
+        TOMBSTONE = -2
+    };
+    std::vector<int32_t> slots;
+    size_t used_slots = 0;
+
+    static constexpr size_t MIN_COMPACT_SIZE = 1024;
+
+    // Returns the slot holding obj, or EMPTY
+    long find_slot(VALUE obj) const {
+        if (slots.empty()) return EMPTY;
+
+        size_t mask = slots.size() - 1;
+        size_t slot = mix_hash(obj) & mask;
+        while (slots[slot] != EMPTY) {
+            if (slots[slot] >= 0 && entries[slots[slot]].obj == obj) {
+                return slot;
+            }
+            slot = (slot + 1) & mask;
+        }
+        return EMPTY;
+    }
+
+    void insert_slot(VALUE obj, int32_t entry_idx) {
+        size_t mask = slots.size() - 1;
+        size_t slot = mix_hash(obj) & mask;
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & mask;
+        }
+        if (slots[slot] == EMPTY) used_slots++;
+        slots[slot] = entry_idx;
+    }
+
+    // Rebuilds the index with room for at least capacity entries, dropping
+    // every tombstone
+    void rebuild_slots(size_t capacity) {
+        size_t size = 1024;
+        while (size < capacity * 2) size *= 2;
+
+        slots.assign(size, EMPTY);
+        used_slots = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].obj) {
+                insert_slot(entries[i].obj, i);
+            }
+        }
+    }
+
+    // Closes up the holes left by freed objects
+    void compact() {
+        size_t kept = 0;
+        for (const auto &entry : entries) {
+            if (entry.obj) {
+                entries[kept++] = entry;
+            }
+        }
+        entries.resize(kept);
+        entries.shrink_to_fit();
+
+        rebuild_slots(live);
+    }
+
+    public:
+
+    void insert(VALUE obj, int stack_index) {
+        // We may have missed the free of an object at this address
+        erase(obj);
+
+        if ((used_slots + 1) * 2 > slots.size()) {
+            rebuild_slots((live + 1) * 2);
+        }
+
+        entries.push_back(Entry{obj, stack_index});
+        insert_slot(obj, entries.size() - 1);
+        live++;
+    }
+
+    void erase(VALUE obj) {
+        long slot = find_slot(obj);
+        if (slot == EMPTY) return;
+
+        entries[slots[slot]].obj = 0;
+        slots[slot] = TOMBSTONE;
+        live--;
+
+        if (entries.size() >= MIN_COMPACT_SIZE && live * 2 < entries.size()) {
+            compact();
+        }
+    }
+
+    size_t size() const {
+        return live;
+    }
+
+    void clear() {
+        entries.clear();
+        entries.shrink_to_fit();
+        slots.clear();
+        slots.shrink_to_fit();
+        live = 0;
+        used_slots = 0;
+    }
+
+    // Calls f(obj, stack_index) for each live object, oldest first
+    template <typename F>
+    void each(F f) const {
+        for (const auto &entry : entries) {
+            if (entry.obj) {
+                f(entry.obj, entry.stack_index);
+            }
+        }
+    }
+};
+
 class RetainedCollector : public BaseCollector {
     void reset() {
-        object_frames.clear();
-        object_list.clear();
+        objects.clear();
 
         BaseCollector::reset();
     }
 
     void record(VALUE obj) {
-        RawSample sample;
         sample.sample();
         int stack_index = frame_list.stack_index(sample);
 
-        object_list.push_back(obj);
-        object_frames.emplace(obj, stack_index);
+        objects.insert(obj, stack_index);
     }
 
-    std::unordered_map<VALUE, int> object_frames;
-    std::vector<VALUE> object_list;
+    ObjectTable objects;
+    RawSample sample;
 
     VALUE tp_newobj = Qnil;
     VALUE tp_freeobj = Qnil;
@@ -1107,11 +2980,13 @@ class RetainedCollector : public BaseCollector {
         rb_trace_arg_t *tparg = rb_tracearg_from_tracepoint(tpval);
         VALUE obj = rb_tracearg_object(tparg);
 
-        collector->object_frames.erase(obj);
+        collector->objects.erase(obj);
     }
 
     public:
 
+    RetainedCollector(int max_depth) : BaseCollector(max_depth), sample(max_depth) {}
+
     bool start() {
         if (!BaseCollector::start()) {
             return false;
@@ -1170,25 +3045,22 @@ class RetainedCollector : public BaseCollector {
         rb_hash_aset(threads, ULL2NUM(0), thread_hash);
 
         rb_hash_aset(thread_hash, sym("tid"), ULL2NUM(0));
-        VALUE samples = rb_ary_new();
-        rb_hash_aset(thread_hash, sym("samples"), samples);
-        VALUE weights = rb_ary_new();
-        rb_hash_aset(thread_hash, sym("weights"), weights);
 
         rb_hash_aset(thread_hash, sym("name"), rb_str_new_cstr("retained memory"));
         rb_hash_aset(thread_hash, sym("started_at"), ULL2NUM(collector->started_at.nanoseconds()));
 
-        for (auto& obj: collector->object_list) {
-            const auto search = collector->object_frames.find(obj);
-            if (search != collector->object_frames.end()) {
-                int stack_index = search->second;
-
-                rb_ary_push(samples, INT2NUM(stack_index));
-                rb_ary_push(weights, INT2NUM(rb_obj_memsize_of(obj)));
-            }
-        }
-
-        frame_list.write_result(result);
+        std::vector<int32_t> samples, weights;
+        samples.reserve(collector->objects.size());
+        weights.reserve(collector->objects.size());
+        collector->objects.each([&](VALUE obj, int stack_index) {
+            samples.push_back(stack_index);
+            weights.push_back(rb_obj_memsize_of(obj));
+        });
+        rb_hash_aset(thread_hash, sym("samples"), int_column(samples, packed));
+        rb_hash_aset(thread_hash, sym("weights"), int_column(weights, packed));
+
+        frame_list.write_result(result, packed);
+        write_meta(result);
 
         return result;
     }
@@ -1205,8 +3077,154 @@ class RetainedCollector : public BaseCollector {
     }
 };
 
+// Samples allocations rather than recording every one: the stack is only
+// walked every interval allocations (or, with randomize, after a
+// geometrically distributed number of them with that mean, so that
+// allocation patterns can't line up with the sampling). Each sample is
+// weighted by the interval so totals estimate the real allocation count.
+class AllocationCollector : public BaseCollector {
+    struct AllocationThread {
+        VALUE ruby_thread;
+        native_thread_id_t native_tid;
+        TimeStamp started_at;
+        SampleTranslator translator;
+        SampleList samples;
+    };
+
+    std::unordered_map<VALUE, std::unique_ptr<AllocationThread>> threads;
+
+    // Kept off the machine stack, as the conservative GC would find stale
+    // frames left there
+    RawSample sample;
+
+    uint32_t interval;
+    bool randomize;
+    uint32_t countdown;
+
+    std::mt19937_64 random;
+    std::geometric_distribution<uint32_t> distribution;
+
+    VALUE tp_newobj = Qnil;
+
+    void reset() {
+        threads.clear();
+
+        BaseCollector::reset();
+    }
+
+    uint32_t next_countdown() {
+        if (!randomize) return interval;
+
+        // Number of failures before the first success, so add one
+        return distribution(random) + 1;
+    }
+
+    void record() {
+        VALUE thread = rb_thread_current();
+        auto it = threads.find(thread);
+        if (it == threads.end()) {
+            AllocationThread *allocation_thread = new AllocationThread();
+            allocation_thread->samples.set_pool(&sample_pool);
+            allocation_thread->ruby_thread = thread;
+            allocation_thread->native_tid = get_native_thread_id();
+            allocation_thread->started_at = TimeStamp::Now();
+            it = threads.emplace(thread, std::unique_ptr<AllocationThread>(allocation_thread)).first;
+        }
+        AllocationThread &allocation_thread = *it->second;
+
+        sample.sample();
+        if (sample.empty()) return;
+
+        int stack_index = allocation_thread.translator.translate(frame_list, sample);
+        allocation_thread.samples.record_sample(stack_index, TimeStamp::Now(), CATEGORY_NORMAL, interval, current_label_id);
+    }
+
+    static void newobj_i(VALUE, void *data) {
+        AllocationCollector *collector = static_cast<AllocationCollector *>(data);
+
+        if (--collector->countdown > 0) return;
+        collector->countdown = collector->next_countdown();
+
+        collector->record();
+    }
+
+    public:
+
+    AllocationCollector(int max_depth, uint32_t interval, bool randomize) :
+        BaseCollector(max_depth),
+        sample(max_depth),
+        interval(interval),
+        randomize(randomize),
+        random(std::random_device()()),
+        distribution(1.0 / interval) {
+        countdown = next_countdown();
+    }
+
+    bool start() {
+        if (!BaseCollector::start()) {
+            return false;
+        }
+
+        tp_newobj = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, newobj_i, this);
+        rb_tracepoint_enable(tp_newobj);
+
+        return true;
+    }
+
+    VALUE stop() {
+        BaseCollector::stop();
+
+        // Don't sample our own allocations while building the result
+        rb_tracepoint_disable(tp_newobj);
+        tp_newobj = Qnil;
+
+        frame_list.finalize();
+
+        VALUE result = build_collector_result();
+
+        reset();
+
+        return result;
+    }
+
+    VALUE build_collector_result() {
+        VALUE result = BaseCollector::build_collector_result();
+
+        VALUE threads = rb_hash_new();
+        rb_ivar_set(result, rb_intern("@threads"), threads);
+
+        for (const auto &entry : this->threads) {
+            const AllocationThread &thread = *entry.second;
+            VALUE hash = rb_hash_new();
+            thread.samples.write_result(hash, packed);
+
+            rb_hash_aset(threads, rb_obj_id(thread.ruby_thread), hash);
+            rb_hash_aset(hash, sym("tid"), ULL2NUM(thread.native_tid));
+            rb_hash_aset(hash, sym("started_at"), ULL2NUM(thread.started_at.nanoseconds()));
+            rb_hash_aset(hash, sym("name"), rb_str_new_cstr(""));
+        }
+
+        frame_list.write_result(result, packed);
+        write_meta(result);
+
+        return result;
+    }
+
+    void mark() {
+        frame_list.mark_frames();
+
+        for (const auto &entry : threads) {
+            rb_gc_mark(entry.first);
+        }
+
+        rb_gc_mark(tp_newobj);
+    }
+};
+
 class GlobalSignalHandler {
-    static LiveSample *live_sample;
+    // The samples being taken, one per signalled thread
+    static LiveSample *const *live_samples;
+    static size_t live_count;
 
     public:
         static GlobalSignalHandler *get_instance() {
@@ -1228,26 +3246,40 @@ class GlobalSignalHandler {
             if (count == 0) clear_signal_handler();
         }
 
-        void record_sample(LiveSample &sample, pthread_t pthread_id) {
+        // Signals every sample's thread before waiting on any of them, so
+        // that they're all sampled at about the same moment, and this takes
+        // as long as the slowest rather than all of them put together
+        void record_samples(LiveSample *const *samples, size_t count) {
             const std::lock_guard<std::mutex> lock(mutex);
 
-            assert(pthread_id);
-
-            live_sample = &sample;
-            if (pthread_kill(pthread_id, SIGPROF)) {
-                rb_bug("pthread_kill failed");
+            live_samples = samples;
+            live_count = count;
+            for (size_t i = 0; i < count; i++) {
+                assert(samples[i]->pthread_id);
+                if (pthread_kill(samples[i]->pthread_id, SIGPROF)) {
+                    rb_bug("pthread_kill failed");
+                }
+            }
+            for (size_t i = 0; i < count; i++) {
+                samples[i]->wait();
             }
-            sample.wait();
-            live_sample = NULL;
+            live_samples = NULL;
+            live_count = 0;
         }
 
     private:
         std::mutex mutex;
         int count;
 
-        static void signal_handler(int sig, siginfo_t* sinfo, void* ucontext) {
-            assert(live_sample);
-            live_sample->sample_current_thread();
+        static void signal_handler(int, siginfo_t*, void* ucontext) {
+            // pthread_self is async-signal-safe in practice
+            pthread_t self = pthread_self();
+            for (size_t i = 0; i < live_count; i++) {
+                if (pthread_equal(live_samples[i]->pthread_id, self)) {
+                    live_samples[i]->sample_current_thread(ucontext);
+                    return;
+                }
+            }
         }
 
         void setup_signal_handler() {
@@ -1266,120 +3298,704 @@ class GlobalSignalHandler {
             sigaction(SIGPROF, &sa, NULL);
         }
 };
-LiveSample *GlobalSignalHandler::live_sample;
-
-class TimeCollector : public BaseCollector {
-    GCMarkerTable gc_markers;
-    ThreadTable threads;
-
-    pthread_t sample_thread;
-
-    atomic_bool running;
-    SamplerSemaphore thread_stopped;
-
-    TimeStamp interval;
-
+LiveSample *const *GlobalSignalHandler::live_samples;
+size_t GlobalSignalHandler::live_count;
+
+// A fixed capacity queue of raw samples. Slots are preallocated so nothing
+// allocates while a thread is stopped in the signal handler. A slot is
+// reserved, the signal handler writes the raw VALUE/line arrays into it, and
+// it's then published, to be translated into the stack table later, outside
+// of any thread locks.
+//
+// Only the CPU collector uses it across threads, as a lock-free single-
+// producer single-consumer queue from each thread's timer signal handler to
+// the drain thread. A TimeCollector's sampler fills and drains its queue
+// itself, where it only holds a tick's batch of samples until their threads'
+// locks are released.
+class SampleQueue {
     public:
-    TimeCollector(TimeStamp interval) : interval(interval), threads(frame_list) {
-    }
+        struct Entry {
+            RawSample sample;
+            Thread *thread;
+            TimeStamp time;
 
-    private:
-
-    void record_sample(const RawSample &sample, TimeStamp time, Thread &thread, Category category) {
-        if (!sample.empty()) {
-            int stack_index = thread.translator.translate(frame_list, sample);
-            thread.samples.record_sample(
-                    stack_index,
-                    time,
-                    thread.native_tid,
-                    category
-                    );
-        }
-    }
-
-    VALUE get_markers() {
-        VALUE list = rb_ary_new();
-        VALUE main_thread = rb_thread_main();
-        VALUE main_thread_id = rb_obj_id(main_thread);
+            // Number of intervals the sample stands for, see CpuThread
+            int weight;
+        };
 
-        for (auto& marker: this->gc_markers.list) {
-            VALUE ary = marker.to_array();
+        constexpr static size_t CAPACITY = 8;
 
-            RARRAY_ASET(ary, 0, main_thread_id);
-            rb_ary_push(list, ary);
+        SampleQueue(int max_depth = RawSample::DEFAULT_MAX_DEPTH, bool native = false) {
+            for (Entry &entry : entries) {
+                entry.sample = RawSample(max_depth, native);
+            }
         }
-        for (auto &thread : threads.list) {
-            for (auto& marker: thread.markers->list) {
-                VALUE ary = marker.to_array();
-                RARRAY_ASET(ary, 0, thread.ruby_thread_id);
-                rb_ary_push(list, ary);
+
+        // Only while nothing is queued
+        void set_native(bool native) {
+            for (Entry &entry : entries) {
+                entry.sample.native = native;
             }
         }
 
-        return list;
-    }
+        // Returns a slot to write into, offset slots past the next one so
+        // that several can be filled at once, or NULL if the queue is full
+        Entry *reserve(size_t offset = 0) {
+            size_t head_idx = head.load(std::memory_order_relaxed) + offset;
+            if (head_idx - tail.load(std::memory_order_acquire) >= CAPACITY) {
+                return NULL;
+            }
+            return &entries[head_idx % CAPACITY];
+        }
 
-    void sample_thread_run() {
-        LiveSample sample;
+        // Makes the next count reserved slots visible to the consumer
+        void publish(size_t count = 1) {
+            head.store(head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+        }
 
-        TimeStamp next_sample_schedule = TimeStamp::Now();
-        while (running) {
-            TimeStamp sample_start = TimeStamp::Now();
+        // Returns the oldest published slot, or NULL if the queue is empty
+        Entry *front() {
+            size_t tail_idx = tail.load(std::memory_order_relaxed);
+            if (tail_idx == head.load(std::memory_order_acquire)) {
+                return NULL;
+            }
+            return &entries[tail_idx % CAPACITY];
+        }
 
-            threads.mutex.lock();
-            for (auto &thread : threads.list) {
-                //if (thread.state == Thread::State::RUNNING) {
-                //if (thread.state == Thread::State::RUNNING || (thread.state == Thread::State::SUSPENDED && thread.stack_on_suspend_idx < 0)) {
-                if (thread.state == Thread::State::RUNNING) {
-                    //fprintf(stderr, "sampling %p on tid:%i\n", thread.ruby_thread, thread.native_tid);
-                    GlobalSignalHandler::get_instance()->record_sample(sample, thread.pthread_id);
+        void pop() {
+            tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
 
-                    if (sample.sample.gc) {
-                        // fprintf(stderr, "skipping GC sample\n");
-                    } else {
-                        record_sample(sample.sample, sample_start, thread, CATEGORY_NORMAL);
-                    }
-                } else if (thread.state == Thread::State::SUSPENDED) {
-                    thread.samples.record_sample(
-                            thread.stack_on_suspend_idx,
-                            sample_start,
-                            thread.native_tid,
-                            CATEGORY_IDLE);
-                } else {
+        // Frames in samples that haven't been translated yet aren't in the
+        // stack table, so they need to be marked separately
+        void mark() {
+            size_t head_idx = head.load(std::memory_order_acquire);
+            for (size_t i = tail.load(std::memory_order_acquire); i != head_idx; i++) {
+                const RawSample &sample = entries[i % CAPACITY].sample;
+                for (int j = 0; j < sample.size(); j++) {
+                    rb_gc_mark(sample.frames[j]);
                 }
             }
+        }
 
-            threads.mutex.unlock();
+    private:
+        Entry entries[CAPACITY];
+        std::atomic<size_t> head{0};
+        std::atomic<size_t> tail{0};
+};
 
-            TimeStamp sample_complete = TimeStamp::Now();
+class TimeCollector;
 
-            next_sample_schedule += interval;
+// Owns the one sampler thread shared by every started TimeCollector. Each
+// time it wakes it gives a tick to every collector which is due, and during
+// that pass a thread's stack is only walked once however many collectors
+// sample it: the first to ask signals the thread, the others get a copy.
+class SamplingHub {
+    public:
+        static SamplingHub &instance() {
+            static SamplingHub hub;
+            return hub;
+        }
 
-            // If sampling falls behind, restart, and check in another interval
-            if (next_sample_schedule < sample_complete) {
-                next_sample_schedule = sample_complete + interval;
-            }
+        // Must hold the GVL
+        void subscribe(TimeCollector *collector);
+        void unsubscribe(TimeCollector *collector);
+
+        // Each subscribed collector calls these around a fork. The sampler
+        // thread is stopped first, so it can't hold a lock the child would
+        // find held forever, and restarted once every collector is done.
+        void prepare_fork();
+        void after_fork();
 
-            TimeStamp::SleepUntil(next_sample_schedule);
+        // Captures from the current pass can be waiting to be copied into
+        // another collector's queue
+        void mark();
+
+        // Keeps passes from running while held. Between passes every
+        // collector's sample queue has been drained.
+        std::unique_lock<std::mutex> lock_passes() {
+            return std::unique_lock<std::mutex>(mutex);
         }
 
-        thread_stopped.post();
-    }
+        // One running thread to be sampled into a RawSample. After capture,
+        // whether it was signalled, and if so how long the handler took.
+        struct Capture {
+            pthread_t pthread_id;
+            RawSample *into;
+            bool signalled;
+            TimeStamp handler_duration;
+        };
+
+        // Samples each running thread, signalling all of those which weren't
+        // already sampled this pass at once. Only called from a tick, with
+        // each of the threads' locks held.
+        void capture(std::vector<Capture> &batch);
+
+    private:
+        // Guards subscribers, and is held for each pass
+        std::mutex mutex;
+        std::vector<TimeCollector *> subscribers;
+
+        pthread_t thread;
+        bool thread_running = false;
+        bool paused = false;
+        SamplerSemaphore thread_stopped;
+
+        int fork_holds = 0;
+
+        void start_thread();
+
+        // A slot for each thread signalled at once, and the ones in use
+        std::vector<std::unique_ptr<LiveSample>> live_samples;
+        std::vector<LiveSample *> signalled;
+
+        // This pass's captures, only used while more than one collector is
+        // subscribed
+        std::vector<std::unique_ptr<RawSample>> captures;
+        size_t captures_used = 0;
+        std::unordered_map<pthread_t, RawSample *> captured;
+        int max_depth = 0;
 
-    static void *sample_thread_entry(void *arg) {
+        // Whether captures take native frames, if any subscriber does
+        bool native = false;
+
+        // Only guards captured, so that marking never waits on a pass. GC
+        // can start while the marking thread holds locks a pass needs.
+        std::mutex captured_mutex;
+
+        void run();
+
+        static void *thread_entry(void *arg) {
 #if HAVE_PTHREAD_SETNAME_NP
 #ifdef __APPLE__
-        pthread_setname_np("Vernier profiler");
+            pthread_setname_np("Vernier profiler");
 #else
-        pthread_setname_np(pthread_self(), "Vernier profiler");
+            pthread_setname_np(pthread_self(), "Vernier profiler");
 #endif
 #endif
-        TimeCollector *collector = static_cast<TimeCollector *>(arg);
-        collector->sample_thread_run();
-        return NULL;
+            static_cast<SamplingHub *>(arg)->run();
+            return NULL;
+        }
+};
+
+class TimeCollector : public BaseCollector {
+    friend class SamplingHub;
+
+    GCMarkerTable gc_markers;
+    ThreadTable threads;
+    SampleQueue sample_queue;
+
+    // Scratch space for capture_suspended_stack
+    RawSample suspended_sample;
+
+    atomic_bool running;
+
+    TimeStamp interval;
+
+    // The sampler's state between ticks, see tick
+    TimeStamp next_sample_schedule;
+    TimeStamp next_symbolicate_schedule;
+    TimeStamp next_evict_schedule;
+    TimeStamp current_interval;
+    TimeStamp last_sample_start;
+    int64_t unweighted_ns;
+    double tick_cost_ns;
+    std::vector<Thread *> thread_snapshot;
+
+    // The running threads to be signalled together, whose locks are held
+    // until they've all been sampled
+    std::vector<SamplingHub::Capture> capture_batch;
+    std::vector<std::unique_lock<std::mutex>> capture_locks;
+
+    // Where the last chunk written by flush left off
+    FrameList::TableSizes flushed_tables;
+    int chunk_index = 0;
+    TimeStamp last_flush_at;
+
+    // In flight recorder mode (window isn't zero) only the last window of
+    // samples and markers are kept, and stack nodes nothing refers to any
+    // more are dropped from the stack table once it has grown enough.
+    TimeStamp window;
+    size_t compact_threshold = MIN_COMPACT_THRESHOLD;
+    static constexpr size_t MIN_COMPACT_THRESHOLD = 4096;
+
+    // Set by evict_before once a thread has stopped before the window, for
+    // the postponed job to remove it, which needs the GVL
+    std::atomic<bool> stopped_threads_evicted{false};
+
+    // Held by dump, during which stack indexes mustn't change
+    std::mutex compact_mutex;
+
+    // If not zero, the fraction of time the sampler aims to spend sampling,
+    // see adapt_interval
+    double target_overhead;
+
+    // Counters for meta[:profiler]. Written by the sampler thread, and read
+    // by flush and dump while it runs.
+    struct SamplerStats {
+        std::atomic<uint64_t> ticks{0};
+        std::atomic<uint64_t> late_ticks{0};
+        std::atomic<uint64_t> missed_ticks{0};
+        std::atomic<uint64_t> slow_ticks{0};
+        std::atomic<uint64_t> tick_ns{0};
+        std::atomic<uint64_t> signal_handler_ns{0};
+        std::atomic<uint64_t> sample_wait_ns{0};
+        std::atomic<uint64_t> translate_ns{0};
+        std::atomic<uint64_t> interval_ns{0};
+        std::atomic<uint64_t> shared_samples{0};
+
+        static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+            counter.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        void reset() {
+            for (auto counter : {&ticks, &late_ticks, &missed_ticks, &slow_ticks, &tick_ns, &signal_handler_ns, &sample_wait_ns, &translate_ns, &interval_ns, &shared_samples}) {
+                counter->store(0, std::memory_order_relaxed);
+            }
+        }
+    } stats;
+
+    // Late and slow ticks, shown on a thread of their own for the sampler
+    MarkerTable profiler_markers;
+    std::atomic<native_thread_id_t> sampler_tid{0};
+
+    // The profiler thread's key in the result's threads. Never a Ruby object
+    // id.
+    static VALUE profiler_thread_id() {
+        return INT2FIX(-1);
+    }
+
+    public:
+    TimeCollector(int max_depth, TimeStamp interval, TimeStamp window, double target_overhead, bool gvl_stacks) : BaseCollector(max_depth), threads(frame_list), sample_queue(max_depth), suspended_sample(max_depth), interval(interval), window(window), target_overhead(target_overhead) {
+        threads.max_depth = max_depth;
+        threads.gvl_stacks = gvl_stacks;
+        threads.sample_pool = &sample_pool;
+        if (!window.zero()) {
+            threads.max_merge_span = evict_interval();
+
+            // Enough for the main thread to fill the window without
+            // allocating. (Eviction then keeps handing blocks back.)
+            sample_pool.reserve(window.nanoseconds() / interval.nanoseconds() * SampleList::BYTES_PER_SAMPLE);
+        }
+    }
+
+    private:
+
+    void record_sample(const RawSample &sample, TimeStamp time, Thread &thread, Category category, int weight) {
+        if (!sample.empty()) {
+            int stack_index = thread.translator.translate(frame_list, sample);
+            thread.samples.record_sample(
+                    stack_index,
+                    time,
+                    category,
+                    weight,
+                    sample.label
+                    );
+        }
+    }
+
+    // Returns the markers recorded since the last call, so that each chunk
+    // of a flushing collector gets its own. In flight recorder mode they're
+    // left in place for the next dump. Markers from all the tables are
+    // merged in order of their start time.
+    VALUE get_markers() {
+        VALUE main_thread = rb_thread_main();
+        VALUE main_thread_id = rb_obj_id(main_thread);
+
+        std::vector<std::pair<VALUE, Marker>> merged;
+        std::vector<Marker> markers;
+        auto take = [&](MarkerTable &table, VALUE thread_id) {
+            if (window.zero()) {
+                table.take(markers);
+            } else {
+                table.copy(markers);
+            }
+            for (const Marker &marker : markers) {
+                merged.emplace_back(thread_id, marker);
+            }
+        };
+
+        take(gc_markers, main_thread_id);
+        take(profiler_markers, profiler_thread_id());
+
+        std::vector<Thread *> thread_list;
+        threads.snapshot(thread_list);
+        for (Thread *thread : thread_list) {
+            take(thread->markers, thread->object_id());
+        }
+
+        std::stable_sort(merged.begin(), merged.end(), [](const std::pair<VALUE, Marker> &a, const std::pair<VALUE, Marker> &b) {
+            return a.second.timestamp < b.second.timestamp;
+        });
+
+        VALUE list = rb_ary_new_capa(merged.size());
+        for (auto &entry : merged) {
+            VALUE ary = entry.second.to_array();
+            RARRAY_ASET(ary, 0, entry.first);
+            rb_ary_push(list, ary);
+        }
+
+        return list;
+    }
+
+    // Translate queued raw samples into stack indexes. This happens after
+    // the per-thread locks are released so GVL events never wait on stack
+    // table insertion.
+    void drain_sample_queue() {
+        const std::lock_guard<std::mutex> lock(frame_list.mutex);
+
+        TimeStamp start = TimeStamp::Now();
+        while (SampleQueue::Entry *entry = sample_queue.front()) {
+            record_sample(entry->sample, entry->time, *entry->thread, CATEGORY_NORMAL, entry->weight);
+            sample_queue.pop();
+        }
+        SamplerStats::add(stats.translate_ns, (TimeStamp::Now() - start).nanoseconds());
+    }
+
+    // Symbolication needs the GVL, so rather than leaving all of it for
+    // stop() we periodically ask for a postponed job on a Ruby thread to
+    // finalize the frames we've seen so far, a time-boxed slice at a time.
+    static constexpr uint64_t SYMBOLICATE_INTERVAL_MS = 100;
+    static constexpr uint64_t SYMBOLICATE_BUDGET_US = 1000;
+
+#if HAVE_RB_POSTPONED_JOB_PREREGISTER
+    static rb_postponed_job_handle_t symbolicate_job_handle;
+#endif
+
+    // All started TimeCollectors. Only modified while holding the GVL, which
+    // the postponed job also holds while it reads this.
+    static std::vector<TimeCollector *> started_collectors;
+
+    static void symbolicate_job(void *) {
+        TimeStamp now = TimeStamp::Now();
+        for (TimeCollector *collector : started_collectors) {
+            if (collector->stopped_threads_evicted.exchange(false)) {
+                collector->remove_stopped_threads(now - collector->window);
+            }
+        }
+
+        TimeStamp deadline = TimeStamp::Now() + TimeStamp::from_microseconds(SYMBOLICATE_BUDGET_US);
+        for (TimeCollector *collector : started_collectors) {
+            if (!collector->frame_list.finalize_until(deadline)) {
+                break;
+            }
+        }
+    }
+
+    void request_symbolication() {
+#if HAVE_RB_POSTPONED_JOB_PREREGISTER
+        if (!stopped_threads_evicted) {
+            const std::lock_guard<std::mutex> lock(frame_list.mutex);
+            if (!frame_list.needs_finalize()) return;
+        }
+
+        // Safe to call from any thread, including ours which isn't a Ruby one
+        rb_postponed_job_trigger(symbolicate_job_handle);
+#endif
+    }
+
+    public:
+    static void init_symbolicate_job() {
+#if HAVE_RB_POSTPONED_JOB_PREREGISTER
+        symbolicate_job_handle = rb_postponed_job_preregister(0, symbolicate_job, NULL);
+#endif
+    }
+
+    private:
+
+    // Captures the stack of a thread which is still suspended, if a tick
+    // has landed in the suspension, so that a result can include its idle
+    // time so far. Must hold the GVL, so that the thread can't run and GC
+    // can't move what its stack refers to, and the thread's lock.
+    void capture_suspended_stack(Thread &thread) {
+#if HAVE_RB_PROFILE_THREAD_FRAMES
+        if (thread.state != Thread::State::SUSPENDED || !thread.stack_on_suspend_pending) return;
+        if (threads.tick_weight == thread.idle_since_tick_weight) return;
+
+        suspended_sample.sample_thread(thread.ruby_thread);
+
+        if (!suspended_sample.empty()) {
+            const std::lock_guard<std::mutex> lock(frame_list.mutex);
+            thread.stack_on_suspend_idx = thread.translator.translate(frame_list, suspended_sample);
+        }
+        thread.stack_on_suspend_pending = false;
+#endif
+    }
+
+    // Samples the batch of running threads, and publishes their queue slots
+    void capture_running_threads() {
+        if (capture_batch.empty()) return;
+
+        TimeStamp signalled_at = TimeStamp::Now();
+        SamplingHub::instance().capture(capture_batch);
+        SamplerStats::add(stats.sample_wait_ns, (TimeStamp::Now() - signalled_at).nanoseconds());
+
+        for (const SamplingHub::Capture &capture : capture_batch) {
+            if (capture.signalled) {
+                SamplerStats::add(stats.signal_handler_ns, capture.handler_duration.nanoseconds());
+            } else {
+                SamplerStats::add(stats.shared_samples, 1);
+            }
+        }
+
+        sample_queue.publish(capture_batch.size());
+        capture_batch.clear();
+        capture_locks.clear();
+    }
+
+    // Records the thread's finished suspensions as idle samples. Caller
+    // holds the thread's lock.
+    void record_suspensions(Thread &thread) {
+        for (const Thread::Suspension &suspension : thread.suspensions) {
+            thread.samples.record_sample(suspension.stack_idx, suspension.from, CATEGORY_IDLE, (int)suspension.weight, suspension.label);
+        }
+        thread.suspensions.clear();
+    }
+
+    // Records the part of the thread's current suspension which hasn't
+    // been recorded yet into samples. With advance, the rest of it will then
+    // be recorded as starting from now. Caller holds the thread's lock.
+    void record_current_suspension(Thread &thread, SampleList &samples, TimeStamp now, bool advance) {
+        if (thread.state != Thread::State::SUSPENDED || thread.stack_on_suspend_idx < 0) return;
+
+        uint64_t weight = threads.tick_weight - thread.idle_since_tick_weight;
+        if (weight == 0) return;
+
+        samples.record_sample(thread.stack_on_suspend_idx, thread.idle_since, CATEGORY_IDLE, (int)weight, thread.label_on_suspend);
+        if (advance) {
+            thread.idle_since = now;
+            thread.idle_since_tick_weight += weight;
+        }
+    }
+
+    // How often we evict, and so how much more than the window we may keep
+    TimeStamp evict_interval() const {
+        TimeStamp min = TimeStamp::from_milliseconds(10);
+        TimeStamp fraction = TimeStamp::from_nanoseconds(window.nanoseconds() / 16);
+        return fraction < min ? min : fraction;
+    }
+
+    // Called on the sampler thread in flight recorder mode
+    void evict_before(TimeStamp cutoff) {
+        gc_markers.evict_before(cutoff);
+        profiler_markers.evict_before(cutoff);
+
+        std::vector<Thread *> thread_list;
+        threads.snapshot(thread_list);
+
+        // Lock order is always Thread::mutex -> FrameList::mutex.
+        // Threads only ever take their own lock, so holding all of
+        // them at once here is safe.
+        std::vector<std::unique_lock<std::mutex>> thread_locks;
+        for (Thread *thread : thread_list) {
+            thread->markers.evict_before(cutoff);
+            thread_locks.emplace_back(thread->mutex);
+        }
+        const std::lock_guard<std::mutex> lock(frame_list.mutex);
+
+        TimeStamp now = TimeStamp::Now();
+        for (Thread *thread : thread_list) {
+            record_suspensions(*thread);
+            record_current_suspension(*thread, thread->samples, now, true);
+            thread->samples.evict_before(cutoff);
+            if (!thread->stopped_at.zero() && thread->stopped_at < cutoff) {
+                stopped_threads_evicted = true;
+            }
+        }
+
+        if (frame_list.stack_node_list.size() < compact_threshold) return;
+
+        std::unique_lock<std::mutex> compact_lock(compact_mutex, std::try_to_lock);
+        if (!compact_lock.owns_lock()) return;
+
+        compact_stack_nodes(thread_list);
+        compact_threshold = frame_list.stack_node_list.size() * 2;
+        if (compact_threshold < MIN_COMPACT_THRESHOLD) compact_threshold = MIN_COMPACT_THRESHOLD;
+    }
+
+    // Must hold every thread's lock, and the frame list lock
+    void compact_stack_nodes(const std::vector<Thread *> &thread_list) {
+        std::vector<bool> live(frame_list.stack_node_list.size());
+
+        gc_markers.mark_live_stacks(live);
+        for (Thread *thread : thread_list) {
+            thread->samples.mark_live_stacks(live);
+            if (thread->stack_on_suspend_idx >= 0) {
+                live[thread->stack_on_suspend_idx] = true;
+            }
+            if (thread->gvl_stack_idx >= 0) {
+                live[thread->gvl_stack_idx] = true;
+            }
+            thread->gvl.mark_live_stacks(live);
+            thread->markers.mark_live_stacks(live);
+        }
+
+        std::vector<int> remap = frame_list.compact_stack_nodes(live);
+
+        gc_markers.remap_stacks(remap);
+        for (Thread *thread : thread_list) {
+            thread->samples.remap_stacks(remap);
+            if (thread->stack_on_suspend_idx >= 0) {
+                thread->stack_on_suspend_idx = remap[thread->stack_on_suspend_idx];
+            }
+            if (thread->gvl_stack_idx >= 0) {
+                thread->gvl_stack_idx = remap[thread->gvl_stack_idx];
+            }
+            thread->gvl.remap_stacks(remap);
+            thread->markers.remap_stacks(remap);
+            thread->translator.reset();
+        }
+    }
+
+    // With a target_overhead, we keep a moving average of how long a tick
+    // takes and stretch the interval until ticks take no more than that
+    // fraction of it. It never goes below the configured interval.
+    static constexpr int MAX_INTERVAL_FACTOR = 64;
+
+    TimeStamp adapt_interval(TimeStamp tick_cost, double &tick_cost_ns) {
+        // Exponentially weighted, so a single slow tick (eg. a page fault)
+        // doesn't throw the interval off
+        if (tick_cost_ns == 0) {
+            tick_cost_ns = tick_cost.nanoseconds();
+        } else {
+            tick_cost_ns += (tick_cost.nanoseconds() - tick_cost_ns) * 0.1;
+        }
+
+        double interval_ns = tick_cost_ns / target_overhead;
+        double min_ns = interval.nanoseconds();
+        double max_ns = min_ns * MAX_INTERVAL_FACTOR;
+        if (interval_ns < min_ns) interval_ns = min_ns;
+        if (interval_ns > max_ns) interval_ns = max_ns;
+
+        return TimeStamp::from_nanoseconds(interval_ns);
+    }
+
+    void reset_schedule() {
+        next_sample_schedule = TimeStamp::Now();
+        next_symbolicate_schedule = next_sample_schedule;
+        next_evict_schedule = next_sample_schedule;
+        current_interval = interval;
+        last_sample_start = TimeStamp();
+        unweighted_ns = 0;
+        tick_cost_ns = 0;
+    }
+
+    // Whether the hub should tick us now. A tick a little early is fine as
+    // its weight accounts for the time it covers, and it lets collectors
+    // with different intervals share a pass.
+    bool tick_due(TimeStamp now) const {
+        return next_sample_schedule <= now + TimeStamp::from_nanoseconds(current_interval.nanoseconds() / 4);
+    }
+
+    // Called by the SamplingHub on its thread
+    void tick() {
+        if (sampler_tid == 0) sampler_tid = get_native_thread_id();
+
+        TimeStamp sample_start = TimeStamp::Now();
+        TimeStamp scheduled = next_sample_schedule;
+
+        // A tick more than an interval behind schedule has missed at
+        // least one, usually because the sampler was descheduled
+        SamplerStats::add(stats.ticks, 1);
+        TimeStamp lateness = sample_start - scheduled;
+        if (lateness >= current_interval) {
+            SamplerStats::add(stats.late_ticks, 1);
+            SamplerStats::add(stats.missed_ticks, lateness.nanoseconds() / current_interval.nanoseconds());
+            profiler_markers.record_interval(Marker::Type::MARKER_PROFILER_LATE_TICK, scheduled, sample_start);
+        }
+
+        // Weight samples by the time since the last tick (in intervals),
+        // so that ticks which are late or were stretched out by the
+        // adaptive interval still account for the time they represent.
+        // The leftover is carried forward so that no time is lost to
+        // rounding.
+        int weight = 1;
+        if (!last_sample_start.zero()) {
+            unweighted_ns += (sample_start - last_sample_start).nanoseconds();
+            weight = (unweighted_ns + interval.nanoseconds() / 2) / interval.nanoseconds();
+            if (weight < 1) weight = 1;
+            unweighted_ns -= weight * interval.nanoseconds();
+        }
+        last_sample_start = sample_start;
+        threads.tick_weight += weight;
+
+        threads.snapshot(thread_snapshot);
+        for (Thread *thread_ptr : thread_snapshot) {
+            Thread &thread = *thread_ptr;
+
+            // Checking the state before taking the lock means threads which
+            // aren't running cost us no contention
+            if (thread.state != Thread::State::RUNNING) {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(thread.mutex);
+
+            record_suspensions(thread);
+
+            if (thread.state == Thread::State::RUNNING) {
+                // Each running thread gets the next free queue slot, and
+                // they're signalled together once we run out of threads or
+                // slots. Only with more running threads than slots is a
+                // tick split into several batches.
+                SampleQueue::Entry *entry = sample_queue.reserve(capture_batch.size());
+                if (!entry) {
+                    // Capturing releases the batch's locks, and ours is let
+                    // go too, so that no thread's GVL events wait on
+                    // translating the batch
+                    lock.unlock();
+                    capture_running_threads();
+                    drain_sample_queue();
+                    lock.lock();
+                    if (thread.state != Thread::State::RUNNING) continue;
+                    entry = sample_queue.reserve();
+                }
+
+                // GC samples are left empty, and skipped when drained
+                entry->thread = &thread;
+                entry->time = sample_start;
+                entry->weight = weight;
+                capture_batch.push_back(SamplingHub::Capture{thread.pthread_id, &entry->sample, false, TimeStamp()});
+                capture_locks.push_back(std::move(lock));
+            }
+        }
+
+        capture_running_threads();
+        drain_sample_queue();
+
+        TimeStamp sample_complete = TimeStamp::Now();
+
+        TimeStamp tick_cost = sample_complete - sample_start;
+        SamplerStats::add(stats.tick_ns, tick_cost.nanoseconds());
+        if (tick_cost > current_interval) {
+            SamplerStats::add(stats.slow_ticks, 1);
+            profiler_markers.record_interval(Marker::Type::MARKER_PROFILER_SLOW_TICK, sample_start, sample_complete);
+        }
+
+        if (!window.zero() && next_evict_schedule < sample_complete) {
+            evict_before(sample_complete - window);
+            next_evict_schedule = sample_complete + evict_interval();
+        }
+
+        if (next_symbolicate_schedule < sample_complete) {
+            request_symbolication();
+            next_symbolicate_schedule = sample_complete + TimeStamp::from_milliseconds(SYMBOLICATE_INTERVAL_MS);
+        }
+
+        if (target_overhead > 0) {
+            current_interval = adapt_interval(tick_cost, tick_cost_ns);
+        }
+        stats.interval_ns.store(current_interval.nanoseconds(), std::memory_order_relaxed);
+
+        next_sample_schedule += current_interval;
+
+        // If sampling falls behind, restart, and check in another interval
+        if (next_sample_schedule < sample_complete) {
+            next_sample_schedule = sample_complete + current_interval;
+        }
     }
 
-    static void internal_thread_event_cb(rb_event_flag_t event, VALUE data, VALUE self, ID mid, VALUE klass) {
+    static void internal_thread_event_cb(rb_event_flag_t event, VALUE data, VALUE self, ID, VALUE) {
         TimeCollector *collector = static_cast<TimeCollector *>((void *)NUM2ULL(data));
 
         switch (event) {
@@ -1392,7 +4008,7 @@ class TimeCollector : public BaseCollector {
         }
     }
 
-    static void internal_gc_event_cb(rb_event_flag_t event, VALUE data, VALUE self, ID mid, VALUE klass) {
+    static void internal_gc_event_cb(rb_event_flag_t event, VALUE data, VALUE, ID, VALUE) {
         TimeCollector *collector = static_cast<TimeCollector *>((void *)NUM2ULL(data));
 
         switch (event) {
@@ -1428,9 +4044,8 @@ class TimeCollector : public BaseCollector {
         thread = rb_thread_current();
 #endif
 
-        auto native_tid = get_native_thread_id();
         //cerr << "internal thread event" << event << " at " << TimeStamp::Now() << endl;
-        //fprintf(stderr, "(%i) th %p to %s\n", native_tid, (void *)thread, gvl_event_name(event));
+        //fprintf(stderr, "(%i) th %p to %s\n", get_native_thread_id(), (void *)thread, gvl_event_name(event));
 
 
         switch (event) {
@@ -1462,13 +4077,18 @@ class TimeCollector : public BaseCollector {
 
         GlobalSignalHandler::get_instance()->install();
 
+        threads.aggregate = aggregate;
+        threads.native = native;
+        sample_queue.set_native(native);
+#if HAVE_NATIVE_STACKS
+        if (native) NativeStack::load_segments();
+#endif
+        started_collectors.push_back(this);
+
         running = true;
 
-        int ret = pthread_create(&sample_thread, NULL, &sample_thread_entry, this);
-        if (ret != 0) {
-            perror("pthread_create");
-            rb_bug("pthread_create");
-        }
+        reset_schedule();
+        SamplingHub::instance().subscribe(this);
 
         // Set the state of the current Ruby thread to RUNNING, which we know it
         // is as it must have held the GVL to start the collector. We want to
@@ -1488,23 +4108,23 @@ class TimeCollector : public BaseCollector {
         BaseCollector::stop();
 
         running = false;
-        thread_stopped.wait();
+        SamplingHub::instance().unsubscribe(this);
 
         GlobalSignalHandler::get_instance()->uninstall();
 
+        started_collectors.erase(std::remove(started_collectors.begin(), started_collectors.end(), this), started_collectors.end());
+
         rb_internal_thread_remove_event_hook(thread_hook);
-        rb_remove_event_hook(internal_gc_event_cb);
-        rb_remove_event_hook(internal_thread_event_cb);
+        rb_remove_event_hook_with_data(internal_gc_event_cb, PTR2NUM((void *)this));
+        rb_remove_event_hook_with_data(internal_thread_event_cb, PTR2NUM((void *)this));
 
         // capture thread names
         for (auto& thread: this->threads.list) {
-            if (thread.running()) {
-                thread.capture_name();
+            if (thread->running()) {
+                thread->capture_name();
             }
         }
 
-        frame_list.finalize();
-
         VALUE result = build_collector_result();
 
         reset();
@@ -1512,125 +4132,2032 @@ class TimeCollector : public BaseCollector {
         return result;
     }
 
+    void reset() {
+        BaseCollector::reset();
+        flushed_tables = FrameList::TableSizes();
+        chunk_index = 0;
+        last_flush_at = TimeStamp();
+        compact_threshold = MIN_COMPACT_THRESHOLD;
+        stats.reset();
+        sampler_tid = 0;
+        threads.lock_wait_ns = 0;
+        threads.lock_contended = 0;
+    }
+
+    void prepare_fork() {
+        SamplingHub::instance().prepare_fork();
+    }
+
+    bool after_fork(bool child) {
+        if (child) {
+            threads.after_fork();
+            gc_markers.clear();
+            profiler_markers.clear();
+            reset();
+
+            started_at = TimeStamp::Now();
+            reset_schedule();
+            threads.resumed(rb_thread_current());
+        }
+        SamplingHub::instance().after_fork();
+        return child;
+    }
+
+    // Seals everything recorded since the last flush into a chunk while
+    // collection carries on, so long running profiles don't have to keep it
+    // all in memory. Each chunk carries the part of the stack, frame and func
+    // tables added since the previous one, so that concatenating them in
+    // order rebuilds the whole profile. Once a collector has been flushed,
+    // stopping it returns the final chunk.
+    VALUE flush() {
+        if (!running) {
+            rb_raise(rb_eRuntimeError, "collector not running");
+        }
+        if (!window.zero()) {
+            rb_raise(rb_eRuntimeError, "can't flush a collector with a window, use dump");
+        }
+
+        // The last chunk, and the markers taken after it, covered these
+        remove_stopped_threads(last_flush_at);
+
+        return build_collector_result();
+    }
+
+    // Must hold the GVL
+    void remove_stopped_threads(TimeStamp before) {
+        auto pass_lock = SamplingHub::instance().lock_passes();
+        threads.remove_stopped_before(before);
+    }
+
+    // Returns a result covering the current window, and the markers for it,
+    // while collection carries on
+    VALUE dump() {
+        if (!running) {
+            rb_raise(rb_eRuntimeError, "collector not running");
+        }
+        if (window.zero()) {
+            rb_raise(rb_eRuntimeError, "only collectors with a window can be dumped");
+        }
+
+        remove_stopped_threads(TimeStamp::Now() - window);
+
+        const std::lock_guard<std::mutex> compact_lock(compact_mutex);
+
+        VALUE result = build_result(false);
+        VALUE markers = get_markers();
+        return rb_assoc_new(result, markers);
+    }
+
     VALUE build_collector_result() {
+        return build_result(true);
+    }
+
+    void write_profiler_stats(VALUE hash) {
+        BaseCollector::write_profiler_stats(hash);
+
+        auto count = [&](const char *name, const std::atomic<uint64_t> &counter) {
+            rb_hash_aset(hash, sym(name), ULL2NUM(counter.load(std::memory_order_relaxed)));
+        };
+        count("ticks", stats.ticks);
+        count("late_ticks", stats.late_ticks);
+        count("missed_ticks", stats.missed_ticks);
+        count("slow_ticks", stats.slow_ticks);
+        count("tick_ns", stats.tick_ns);
+        count("signal_handler_ns", stats.signal_handler_ns);
+        count("sample_wait_ns", stats.sample_wait_ns);
+        count("translate_ns", stats.translate_ns);
+        count("interval_ns", stats.interval_ns);
+        count("shared_samples", stats.shared_samples);
+        count("thread_table_wait_ns", threads.lock_wait_ns);
+        count("thread_table_contended", threads.lock_contended);
+        rb_hash_aset(hash, sym("threads"), SIZET2NUM(threads.size()));
+    }
+
+    // Either seals the samples recorded so far into the result (for stop and
+    // flush), or copies them leaving the collector as it was (for dump).
+    VALUE build_result(bool consume) {
         VALUE result = BaseCollector::build_collector_result();
 
         VALUE threads = rb_hash_new();
         rb_ivar_set(result, rb_intern("@threads"), threads);
 
-        for (const auto& thread: this->threads.list) {
+        std::vector<Thread *> thread_list;
+        this->threads.snapshot(thread_list);
+
+        TimeStamp flushed_at = TimeStamp::Now();
+        for (Thread *thread_ptr : thread_list) {
+            Thread &thread = *thread_ptr;
+
+            // Holding both locks keeps the sampler from recording into the
+            // list while we swap it out
+            SampleList samples;
+            GvlStats gvl;
+            native_thread_id_t native_tid;
+            TimeStamp started_at, stopped_at;
+            {
+                const std::lock_guard<std::mutex> lock(thread.mutex);
+                capture_suspended_stack(thread);
+                const std::lock_guard<std::mutex> frame_lock(frame_list.mutex);
+                record_suspensions(thread);
+                if (consume) {
+                    samples = thread.samples.take();
+                    gvl = thread.gvl.take();
+                } else {
+                    samples = thread.samples;
+                    gvl = thread.gvl;
+                }
+
+                // A thread still suspended gets its idle time so far, and
+                // when consuming, the next result starts from here
+                record_current_suspension(thread, samples, flushed_at, consume);
+                native_tid = thread.native_tid;
+                started_at = thread.started_at;
+                stopped_at = thread.stopped_at;
+            }
+
+            // Already written out as stopped by an earlier chunk, or stopped
+            // before the window
+            if (!stopped_at.zero() && stopped_at < last_flush_at) {
+                continue;
+            }
+            if (!window.zero() && !stopped_at.zero() && stopped_at < flushed_at - window) {
+                continue;
+            }
+
             VALUE hash = rb_hash_new();
-            thread.samples.write_result(hash);
+            samples.write_result(hash, packed);
+            if (!gvl.empty()) {
+                VALUE gvl_hash = rb_hash_new();
+                gvl.write_result(gvl_hash);
+                rb_hash_aset(hash, sym("gvl"), gvl_hash);
+            }
 
-            rb_hash_aset(threads, thread.ruby_thread_id, hash);
-            rb_hash_aset(hash, sym("tid"), ULL2NUM(thread.native_tid));
-            rb_hash_aset(hash, sym("started_at"), ULL2NUM(thread.started_at.nanoseconds()));
-            if (!thread.stopped_at.zero()) {
-                rb_hash_aset(hash, sym("stopped_at"), ULL2NUM(thread.stopped_at.nanoseconds()));
+            rb_hash_aset(threads, thread.object_id(), hash);
+            rb_hash_aset(hash, sym("tid"), ULL2NUM(native_tid));
+            rb_hash_aset(hash, sym("started_at"), ULL2NUM(started_at.nanoseconds()));
+            if (!stopped_at.zero()) {
+                rb_hash_aset(hash, sym("stopped_at"), ULL2NUM(stopped_at.nanoseconds()));
             }
             rb_hash_aset(hash, sym("name"), rb_str_new(thread.name.data(), thread.name.length()));
 
         }
 
-        frame_list.write_result(result);
+        // The sampler has no samples of its own, only markers
+        VALUE profiler_hash = rb_hash_new();
+        SampleList().write_result(profiler_hash, packed);
+        rb_hash_aset(threads, profiler_thread_id(), profiler_hash);
+        rb_hash_aset(profiler_hash, sym("tid"), ULL2NUM(sampler_tid));
+        rb_hash_aset(profiler_hash, sym("started_at"), ULL2NUM(started_at.nanoseconds()));
+        rb_hash_aset(profiler_hash, sym("name"), rb_str_new_cstr("Vernier profiler"));
+
+        // Every stack the samples we took refer to is in the table by now
+        frame_list.finalize();
+
+        if (!consume) {
+            frame_list.write_result(result, packed);
+            write_meta(result);
+            return result;
+        }
+
+        FrameList::TableSizes from = flushed_tables;
+        flushed_tables = frame_list.write_result(result, packed, from);
+        write_meta(result);
+
+        if (running || chunk_index > 0) {
+            VALUE chunk = rb_hash_new();
+            rb_hash_aset(rb_ivar_get(result, rb_intern("@meta")), sym("chunk"), chunk);
+            rb_hash_aset(chunk, sym("index"), INT2NUM(chunk_index));
+            rb_hash_aset(chunk, sym("stack_offset"), SIZET2NUM(from.stacks));
+            rb_hash_aset(chunk, sym("frame_offset"), SIZET2NUM(from.frames));
+            rb_hash_aset(chunk, sym("func_offset"), SIZET2NUM(from.funcs));
+            chunk_index++;
+        }
+        last_flush_at = flushed_at;
 
         return result;
     }
 
     void mark() {
+        const std::lock_guard<std::mutex> lock(frame_list.mutex);
+
         frame_list.mark_frames();
+        sample_queue.mark();
         threads.mark();
-
-        //for (int i = 0; i < queued_length; i++) {
-        //    rb_gc_mark(queued_frames[i]);
-        //}
-
-        // FIXME: How can we best mark buffered or pending frames?
+        SamplingHub::instance().mark();
     }
 };
 
-static void
-collector_mark(void *data) {
-    BaseCollector *collector = static_cast<BaseCollector *>(data);
+#if HAVE_RB_POSTPONED_JOB_PREREGISTER
+rb_postponed_job_handle_t TimeCollector::symbolicate_job_handle;
+#endif
+std::vector<TimeCollector *> TimeCollector::started_collectors;
+
+void SamplingHub::subscribe(TimeCollector *collector) {
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    subscribers.push_back(collector);
+    if (collector->max_depth > max_depth) {
+        max_depth = collector->max_depth;
+        captures.clear();
+    }
+    if (collector->native && !native) {
+        native = true;
+        captures.clear();
+    }
+
+    if (!thread_running) {
+        start_thread();
+    }
+}
+
+void SamplingHub::start_thread() {
+    thread_running = true;
+    int ret = pthread_create(&thread, NULL, &thread_entry, this);
+    if (ret != 0) {
+        perror("pthread_create");
+        rb_bug("pthread_create");
+    }
+}
+
+void SamplingHub::prepare_fork() {
+    if (fork_holds++ > 0 || !thread_running) return;
+
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        paused = true;
+    }
+    thread_stopped.wait();
+    thread_running = false;
+}
+
+void SamplingHub::after_fork() {
+    if (--fork_holds > 0) return;
+
+    paused = false;
+    if (!subscribers.empty()) {
+        start_thread();
+    }
+}
+
+void SamplingHub::unsubscribe(TimeCollector *collector) {
+    bool last;
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), collector), subscribers.end());
+        last = subscribers.empty();
+    }
+
+    // The thread notices there's nobody left when it next wakes
+    if (last) {
+        thread_stopped.wait();
+        thread_running = false;
+        max_depth = 0;
+        native = false;
+        captures.clear();
+    }
+}
+
+void SamplingHub::mark() {
+    const std::lock_guard<std::mutex> lock(captured_mutex);
+    for (auto &pair : captured) {
+        const RawSample &sample = *pair.second;
+        for (int i = 0; i < sample.len; i++) {
+            rb_gc_mark(sample.frames[i]);
+        }
+    }
+}
+
+void SamplingHub::capture(std::vector<Capture> &batch) {
+    // Nobody to share with
+    bool shared = subscribers.size() > 1;
+
+    signalled.clear();
+    for (Capture &capture : batch) {
+        capture.signalled = false;
+
+        RawSample *sample = capture.into;
+        if (shared) {
+            {
+                const std::lock_guard<std::mutex> lock(captured_mutex);
+                auto it = captured.find(capture.pthread_id);
+                if (it != captured.end()) {
+                    capture.into->copy_from(*it->second);
+                    continue;
+                }
+            }
+
+            if (captures_used == captures.size()) {
+                captures.emplace_back(new RawSample(max_depth, native));
+            }
+            sample = captures[captures_used++].get();
+        }
+
+        if (signalled.size() == live_samples.size()) {
+            live_samples.emplace_back(new LiveSample());
+        }
+        LiveSample *live = live_samples[signalled.size()].get();
+        live->sample = sample;
+        live->pthread_id = capture.pthread_id;
+        signalled.push_back(live);
+        capture.signalled = true;
+    }
+
+    if (signalled.empty()) return;
+    GlobalSignalHandler::get_instance()->record_samples(signalled.data(), signalled.size());
+
+    size_t slot = 0;
+    for (Capture &capture : batch) {
+        if (!capture.signalled) continue;
+
+        LiveSample *live = signalled[slot++];
+        capture.handler_duration = live->handler_duration;
+        if (shared) {
+            {
+                const std::lock_guard<std::mutex> lock(captured_mutex);
+                captured[capture.pthread_id] = live->sample;
+            }
+            capture.into->copy_from(*live->sample);
+        }
+    }
+}
+
+void SamplingHub::run() {
+    while (true) {
+        TimeStamp wake;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            if (subscribers.empty() || paused) break;
+
+            TimeStamp now = TimeStamp::Now();
+            for (TimeCollector *collector : subscribers) {
+                if (collector->tick_due(now)) {
+                    collector->tick();
+                }
+            }
+
+            {
+                const std::lock_guard<std::mutex> captured_lock(captured_mutex);
+                captured.clear();
+            }
+            captures_used = 0;
+
+            wake = subscribers[0]->next_sample_schedule;
+            for (TimeCollector *collector : subscribers) {
+                if (collector->next_sample_schedule < wake) {
+                    wake = collector->next_sample_schedule;
+                }
+            }
+        }
+
+        TimeStamp::SleepUntil(wake);
+    }
+
+    thread_stopped.post();
+}
+
+#if HAVE_CPU_TIMERS
+struct CpuThread;
+
+// Where a CPU timer's signals find their CpuThread. Targets are never freed,
+// only reused, so that a signal still pending for a deleted timer always
+// finds one: either empty, or taken by a CpuThread since. That could be for
+// another thread, which the handler tells apart by pthread id.
+struct CpuTimerTarget {
+    std::atomic<CpuThread *> thread{NULL};
+};
+
+// CPU timers deliver a realtime signal of their own rather than SIGPROF.
+// Ordinary signals aren't queued twice, so one of the wall sampler's
+// signals could otherwise be merged into a pending timer signal and never
+// be answered.
+class CpuTimerSignal {
+    public:
+        // One Ruby doesn't use
+        static int number() {
+            return SIGRTMIN + 4;
+        }
+
+        // Must hold the GVL
+        static void install() {
+            if (installed++ > 0) return;
+
+            struct sigaction sa;
+            sa.sa_sigaction = signal_handler;
+            sa.sa_flags = SA_RESTART | SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            sigaction(number(), &sa, NULL);
+        }
+
+        // Ignored rather than reset, as the default action for a realtime
+        // signal is to terminate
+        static void uninstall() {
+            if (--installed > 0) return;
+
+            struct sigaction sa;
+            sa.sa_handler = SIG_IGN;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            sigaction(number(), &sa, NULL);
+        }
+
+        static CpuTimerTarget *acquire_target(CpuThread *thread) {
+            CpuTimerTarget *target;
+            {
+                const std::lock_guard<std::mutex> lock(targets_mutex);
+                if (free_targets.empty()) {
+                    target = new CpuTimerTarget();
+                } else {
+                    target = free_targets.back();
+                    free_targets.pop_back();
+                }
+            }
+            target->thread.store(thread);
+            return target;
+        }
+
+        // The thread's timer must already be deleted. The thread mustn't
+        // be freed until wait_for_handlers returns.
+        static void release_target(CpuTimerTarget *target) {
+            target->thread.store(NULL);
+
+            const std::lock_guard<std::mutex> lock(targets_mutex);
+            free_targets.push_back(target);
+        }
+
+        // Waits out handlers which could have found a CpuThread before its
+        // target was released
+        static void wait_for_handlers() {
+            while (handlers_running.load() > 0) {
+                sched_yield();
+            }
+        }
+
+    private:
+        static int installed;
+        static std::atomic<int> handlers_running;
+
+        static std::mutex targets_mutex;
+        static std::vector<CpuTimerTarget *> free_targets;
+
+        static void signal_handler(int sig, siginfo_t *sinfo, void *ucontext);
+};
+int CpuTimerSignal::installed = 0;
+std::atomic<int> CpuTimerSignal::handlers_running{0};
+std::mutex CpuTimerSignal::targets_mutex;
+std::vector<CpuTimerTarget *> CpuTimerSignal::free_targets;
+
+// A thread seen by a CpuCollector. Its timer signals the thread itself
+// whenever it has used another interval of CPU time, and the signal handler
+// writes the sample straight into the thread's queue.
+struct CpuThread {
+    VALUE ruby_thread;
+    VALUE ruby_thread_id;
+    native_thread_id_t native_tid;
+
+    // The thread this was created on, and the only one whose signals it
+    // takes samples from
+    pthread_t pthread_id;
+
+    // Set by the thread's own GVL hooks. Its stack is only walked while it
+    // holds the GVL: without it another thread could be running GC or
+    // compaction.
+    std::atomic<bool> holds_gvl{false};
+
+    TimeStamp started_at;
+    TimeStamp stopped_at;
+
+    timer_t timer;
+    CpuTimerTarget *target = NULL;
+    bool armed = false;
+
+    // Only the signal handler on this thread produces, only the drain
+    // thread consumes
+    SampleQueue queue;
+
+    // Only touched by the signal handler
+    int unsampled_weight = 0;
+
+    SampleTranslator translator;
+    SampleList samples;
+
+    CpuThread(VALUE ruby_thread, int max_depth, bool native) : ruby_thread(ruby_thread), queue(max_depth, native) {
+        ruby_thread_id = rb_obj_id(ruby_thread);
+        native_tid = get_native_thread_id();
+        pthread_id = pthread_self();
+        started_at = TimeStamp::Now();
+    }
+
+    // Must be called on the thread itself, as the clock is the calling
+    // thread's CPU time
+    void arm(TimeStamp interval) {
+        target = CpuTimerSignal::acquire_target(this);
+
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = CpuTimerSignal::number();
+        sev.sigev_value.sival_ptr = target;
+        sev.sigev_notify_thread_id = native_tid;
+
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) != 0) {
+            perror("timer_create");
+            forget_timer();
+            return;
+        }
+
+        struct itimerspec its;
+        its.it_interval = interval.timespec();
+        its.it_value = interval.timespec();
+        if (timer_settime(timer, 0, &its, NULL) != 0) {
+            perror("timer_settime");
+            timer_delete(timer);
+            forget_timer();
+            return;
+        }
+
+        armed = true;
+    }
+
+    // No more signals are generated once this returns, but a handler
+    // could still be running on the thread, see
+    // CpuTimerSignal::wait_for_handlers
+    void disarm() {
+        if (!armed) return;
+
+        timer_delete(timer);
+        forget_timer();
+    }
+
+    // For when the timer is already gone, as in a forked child
+    void forget_timer() {
+        if (target) {
+            CpuTimerSignal::release_target(target);
+            target = NULL;
+        }
+        armed = false;
+    }
+
+    // Called from the signal handler. CPU timers are only checked on
+    // scheduler ticks, so with short intervals a signal usually covers more
+    // than one expiry and the sample is weighted by all of them. If we can't
+    // take a sample (during GC, or if the drain thread has fallen behind and
+    // the queue is full) its weight goes to the next one instead. CPU time
+    // used without the GVL isn't recorded at all.
+    void sample_from_timer(int overrun, void *ucontext) {
+        if (!holds_gvl.load(std::memory_order_relaxed)) return;
+
+        unsampled_weight += 1 + overrun;
+
+        SampleQueue::Entry *entry = queue.reserve();
+        if (!entry) return;
+
+        entry->sample.sample(ucontext);
+        if (entry->sample.gc || entry->sample.empty()) return;
+
+        entry->thread = NULL;
+        entry->time = TimeStamp::Now();
+        entry->weight = unsampled_weight;
+        unsampled_weight = 0;
+        queue.publish();
+    }
+};
+
+void CpuTimerSignal::signal_handler(int, siginfo_t *sinfo, void *ucontext) {
+    if (sinfo->si_code != SI_TIMER) return;
+
+    handlers_running.fetch_add(1);
+    CpuTimerTarget *target = static_cast<CpuTimerTarget *>(sinfo->si_value.sival_ptr);
+    CpuThread *thread = target->thread.load();
+    if (thread && pthread_equal(thread->pthread_id, pthread_self())) {
+        thread->sample_from_timer(sinfo->si_overrun, ucontext);
+    }
+    handlers_running.fetch_sub(1);
+}
+
+// Profiles CPU time rather than wall time. Rather than a sampler thread
+// signalling each running thread in turn, every Ruby thread gets a POSIX
+// timer on its own CPU clock (armed the first time it takes the GVL).
+// Threads which are blocked or waiting for the GVL use no CPU and so are
+// never sampled. A background thread periodically moves the queued samples
+// into the stack table.
+class CpuCollector : public BaseCollector {
+    TimeStamp interval;
+
+    // Guards thread_list and thread_map. Threads are never freed while the
+    // collector runs, as a timer signal could still be in flight, and only
+    // after CpuTimerSignal::wait_for_handlers once it stops.
+    std::mutex threads_mutex;
+    std::vector<std::unique_ptr<CpuThread>> thread_list;
+    std::unordered_map<VALUE, CpuThread *> thread_map;
+
+    pthread_t drain_thread;
+    std::atomic<bool> draining{false};
+
+    rb_internal_thread_event_hook_t *thread_hook;
+
+    // How often queued samples are drained. Queues hold 8 samples, so this
+    // leaves plenty of room.
+    TimeStamp drain_interval() const {
+        return interval + interval;
+    }
+
+    CpuThread *find_or_create(VALUE thread) {
+        const std::lock_guard<std::mutex> lock(threads_mutex);
+
+        auto it = thread_map.find(thread);
+        if (it != thread_map.end() && it->second->stopped_at.zero()) {
+            return it->second;
+        }
+
+        CpuThread *cpu_thread = new CpuThread(thread, max_depth, native);
+        cpu_thread->samples.set_pool(&sample_pool);
+        cpu_thread->samples.set_aggregate(aggregate);
+        thread_list.emplace_back(cpu_thread);
+        thread_map[thread] = cpu_thread;
+        return cpu_thread;
+    }
+
+    // Runs on the thread itself
+    void thread_resumed(VALUE thread) {
+        prepare_thread_locals();
+#if HAVE_NATIVE_STACKS
+        if (native) NativeStack::prepare_current_thread();
+#endif
+        CpuThread *cpu_thread = find_or_create(thread);
+        cpu_thread->holds_gvl = true;
+        if (!cpu_thread->armed) {
+            cpu_thread->arm(interval);
+        }
+    }
+
+    // Runs on the thread itself, before it releases the GVL
+    void thread_suspended(VALUE thread) {
+        const std::lock_guard<std::mutex> lock(threads_mutex);
+
+        auto it = thread_map.find(thread);
+        if (it == thread_map.end()) return;
+
+        it->second->holds_gvl = false;
+    }
+
+    void thread_exited(VALUE thread) {
+        const std::lock_guard<std::mutex> lock(threads_mutex);
+
+        auto it = thread_map.find(thread);
+        if (it == thread_map.end()) return;
+
+        CpuThread *cpu_thread = it->second;
+        cpu_thread->holds_gvl = false;
+        cpu_thread->disarm();
+        cpu_thread->stopped_at = TimeStamp::Now();
+    }
+
+    static void internal_thread_event_cb(rb_event_flag_t event, const rb_internal_thread_event_data_t *event_data, void *data) {
+        CpuCollector *collector = static_cast<CpuCollector *>(data);
+        VALUE thread = Qnil;
+
+#if HAVE_RB_INTERNAL_THREAD_EVENT_DATA_T_THREAD
+        thread = event_data->thread;
+#else
+        if (!ruby_native_thread_p()) return;
+
+        thread = rb_thread_current();
+#endif
+
+        switch (event) {
+            case RUBY_INTERNAL_THREAD_EVENT_RESUMED:
+                collector->thread_resumed(thread);
+                break;
+            case RUBY_INTERNAL_THREAD_EVENT_SUSPENDED:
+                collector->thread_suspended(thread);
+                break;
+            case RUBY_INTERNAL_THREAD_EVENT_EXITED:
+                collector->thread_exited(thread);
+                break;
+        }
+    }
+
+    void drain() {
+        const std::lock_guard<std::mutex> lock(threads_mutex);
+        const std::lock_guard<std::mutex> frame_lock(frame_list.mutex);
+
+        for (auto &cpu_thread : thread_list) {
+            while (SampleQueue::Entry *entry = cpu_thread->queue.front()) {
+                int stack_index = cpu_thread->translator.translate(frame_list, entry->sample);
+                cpu_thread->samples.record_sample(stack_index, entry->time, CATEGORY_NORMAL, entry->weight, entry->sample.label);
+                cpu_thread->queue.pop();
+            }
+        }
+    }
+
+    void drain_thread_run() {
+        TimeStamp next_drain = TimeStamp::Now();
+        while (draining) {
+            drain();
+
+            next_drain += drain_interval();
+            TimeStamp now = TimeStamp::Now();
+            if (next_drain < now) {
+                next_drain = now + drain_interval();
+            }
+            TimeStamp::SleepUntil(next_drain);
+        }
+    }
+
+    static void *drain_thread_entry(void *arg) {
+#if HAVE_PTHREAD_SETNAME_NP
+        pthread_setname_np(pthread_self(), "Vernier drain");
+#endif
+        static_cast<CpuCollector *>(arg)->drain_thread_run();
+        return NULL;
+    }
+
+    public:
+
+    CpuCollector(int max_depth, TimeStamp interval) : BaseCollector(max_depth), interval(interval) {
+    }
+
+    void start_drain_thread() {
+        draining = true;
+        int ret = pthread_create(&drain_thread, NULL, &drain_thread_entry, this);
+        if (ret != 0) {
+            perror("pthread_create");
+            rb_bug("pthread_create");
+        }
+    }
+
+    bool start() {
+        if (!BaseCollector::start()) {
+            return false;
+        }
+
+        {
+            const std::lock_guard<std::mutex> lock(threads_mutex);
+            thread_list.clear();
+            thread_map.clear();
+        }
+
+        CpuTimerSignal::install();
+
+#if HAVE_NATIVE_STACKS
+        if (native) NativeStack::load_segments();
+#endif
+        start_drain_thread();
+
+        // We hold the GVL, so won't see our own RESUMED event until we next
+        // release it
+        thread_resumed(rb_thread_current());
+
+        thread_hook = rb_internal_thread_add_event_hook(
+                internal_thread_event_cb,
+                RUBY_INTERNAL_THREAD_EVENT_RESUMED | RUBY_INTERNAL_THREAD_EVENT_SUSPENDED | RUBY_INTERNAL_THREAD_EVENT_EXITED,
+                this);
+
+        return true;
+    }
+
+    VALUE stop() {
+        BaseCollector::stop();
+
+        rb_internal_thread_remove_event_hook(thread_hook);
+
+        {
+            const std::lock_guard<std::mutex> lock(threads_mutex);
+            for (auto &cpu_thread : thread_list) {
+                cpu_thread->disarm();
+            }
+        }
+        CpuTimerSignal::wait_for_handlers();
+
+        draining = false;
+        pthread_join(drain_thread, NULL);
+        drain();
+
+        CpuTimerSignal::uninstall();
+
+        frame_list.finalize();
+
+        VALUE result = build_collector_result();
+
+        reset();
+
+        return result;
+    }
+
+    // The drain thread is stopped across the fork, so it can't hold a lock
+    // the child would find held forever. Samples wait in the queues.
+    void prepare_fork() {
+        draining = false;
+        pthread_join(drain_thread, NULL);
+    }
+
+    // Timers aren't inherited, so no signal can be in flight for the
+    // parent's threads and they can be freed
+    bool after_fork(bool child) {
+        if (child) {
+            {
+                const std::lock_guard<std::mutex> lock(threads_mutex);
+                for (auto &cpu_thread : thread_list) {
+                    cpu_thread->forget_timer();
+                }
+                thread_list.clear();
+                thread_map.clear();
+            }
+            reset();
+            started_at = TimeStamp::Now();
+        }
+        start_drain_thread();
+
+        if (child) thread_resumed(rb_thread_current());
+        return child;
+    }
+
+    VALUE build_collector_result() {
+        VALUE result = BaseCollector::build_collector_result();
+
+        VALUE threads = rb_hash_new();
+        rb_ivar_set(result, rb_intern("@threads"), threads);
+
+        for (const auto &cpu_thread : thread_list) {
+            const CpuThread &thread = *cpu_thread;
+            VALUE hash = rb_hash_new();
+            thread.samples.write_result(hash, packed);
+
+            rb_hash_aset(threads, thread.ruby_thread_id, hash);
+            rb_hash_aset(hash, sym("tid"), ULL2NUM(thread.native_tid));
+            rb_hash_aset(hash, sym("started_at"), ULL2NUM(thread.started_at.nanoseconds()));
+            if (!thread.stopped_at.zero()) {
+                rb_hash_aset(hash, sym("stopped_at"), ULL2NUM(thread.stopped_at.nanoseconds()));
+            }
+            rb_hash_aset(hash, sym("name"), rb_str_new_cstr(""));
+        }
+
+        frame_list.write_result(result, packed);
+        write_meta(result);
+
+        return result;
+    }
+
+    void mark() {
+        const std::lock_guard<std::mutex> lock(threads_mutex);
+        const std::lock_guard<std::mutex> frame_lock(frame_list.mutex);
+
+        frame_list.mark_frames();
+        for (auto &cpu_thread : thread_list) {
+            cpu_thread->queue.mark();
+        }
+    }
+};
+#endif
+
+static void
+collector_mark(void *data) {
+    BaseCollector *collector = static_cast<BaseCollector *>(data);
     collector->mark();
 }
 
-static void
-collector_free(void *data) {
-    BaseCollector *collector = static_cast<BaseCollector *>(data);
-    delete collector;
-}
+static void
+collector_free(void *data) {
+    BaseCollector *collector = static_cast<BaseCollector *>(data);
+    delete collector;
+}
+
+static const rb_data_type_t rb_collector_type = {
+    .wrap_struct_name = "vernier/collector",
+    .function = {
+        //.dmemsize = rb_collector_memsize,
+        .dmark = collector_mark,
+        .dfree = collector_free,
+        .dsize = NULL,
+        .dcompact = NULL,
+        .reserved = {},
+    },
+    .parent = NULL,
+    .data = NULL,
+    .flags = 0,
+};
+
+static BaseCollector *get_collector(VALUE obj) {
+    BaseCollector *collector;
+    TypedData_Get_Struct(obj, BaseCollector, &rb_collector_type, collector);
+    return collector;
+}
+
+static VALUE
+collector_start(VALUE self) {
+    auto *collector = get_collector(self);
+
+    if (!collector->start()) {
+        rb_raise(rb_eRuntimeError, "already running");
+    }
+
+    return Qtrue;
+}
+
+static VALUE
+collector_stop(VALUE self) {
+    auto *collector = get_collector(self);
+
+    VALUE result = collector->stop();
+    return result;
+}
+
+static VALUE
+markers(VALUE self) {
+    auto *collector = get_collector(self);
+
+    return collector->get_markers();
+}
+
+static VALUE
+collector_dump(VALUE self) {
+    auto *collector = get_collector(self);
+
+    return collector->dump();
+}
+
+static VALUE
+collector_flush(VALUE self) {
+    auto *collector = get_collector(self);
+
+    return collector->flush();
+}
+
+static VALUE
+collector_sample(VALUE self) {
+    auto *collector = get_collector(self);
+
+    collector->sample();
+    return Qtrue;
+}
+
+static VALUE collector_new(VALUE self, VALUE mode, VALUE options) {
+    VALUE max_depthv = rb_hash_aref(options, sym("max_depth"));
+    int max_depth = NIL_P(max_depthv) ? RawSample::DEFAULT_MAX_DEPTH : NUM2INT(max_depthv);
+    if (max_depth <= 0) rb_raise(rb_eArgError, "max_depth must be positive");
+
+    BaseCollector *collector;
+    if (mode == sym("retained")) {
+        collector = new RetainedCollector(max_depth);
+    } else if (mode == sym("custom")) {
+        collector = new CustomCollector(max_depth);
+    } else if (mode == sym("allocation")) {
+        VALUE intervalv = rb_hash_aref(options, sym("interval"));
+        uint32_t interval = NIL_P(intervalv) ? 1000 : NUM2UINT(intervalv);
+        if (interval == 0) rb_raise(rb_eArgError, "interval must be positive");
+        collector = new AllocationCollector(max_depth, interval, RTEST(rb_hash_aref(options, sym("randomize"))));
+    } else if (mode == sym("wall")) {
+        VALUE intervalv = rb_hash_aref(options, sym("interval"));
+        TimeStamp interval;
+        if (NIL_P(intervalv)) {
+            interval = TimeStamp::from_microseconds(500);
+        } else {
+            interval = TimeStamp::from_microseconds(NUM2UINT(intervalv));
+        }
+        VALUE windowv = rb_hash_aref(options, sym("window"));
+        TimeStamp window;
+        if (!NIL_P(windowv)) {
+            double window_s = NUM2DBL(windowv);
+            if (window_s <= 0) rb_raise(rb_eArgError, "window must be positive");
+            window = TimeStamp::from_nanoseconds(window_s * 1e9);
+        }
+        VALUE target_overheadv = rb_hash_aref(options, sym("target_overhead"));
+        double target_overhead = 0;
+        if (!NIL_P(target_overheadv)) {
+            // Given as a percentage
+            target_overhead = NUM2DBL(target_overheadv) / 100;
+            if (target_overhead <= 0 || target_overhead >= 1) rb_raise(rb_eArgError, "target_overhead must be a percentage between 0 and 100");
+        }
+        collector = new TimeCollector(max_depth, interval, window, target_overhead, RTEST(rb_hash_aref(options, sym("gvl_stacks"))));
+    } else if (mode == sym("cpu")) {
+#if HAVE_CPU_TIMERS
+        VALUE intervalv = rb_hash_aref(options, sym("interval"));
+        TimeStamp interval = TimeStamp::from_microseconds(NIL_P(intervalv) ? 1000 : NUM2UINT(intervalv));
+        if (interval.zero()) rb_raise(rb_eArgError, "interval must be positive");
+        collector = new CpuCollector(max_depth, interval);
+#else
+        rb_raise(rb_eNotImpError, "cpu mode requires per-thread CPU timers, which are only supported on Linux");
+#endif
+    } else {
+        rb_raise(rb_eArgError, "invalid mode");
+    }
+    collector->packed = RTEST(rb_hash_aref(options, sym("packed")));
+    if (RTEST(rb_hash_aref(options, sym("aggregate")))) {
+        if (mode != sym("wall") && mode != sym("cpu") && mode != sym("custom")) {
+            delete collector;
+            rb_raise(rb_eArgError, "aggregate is only supported in wall, cpu and custom modes");
+        }
+        if (!NIL_P(rb_hash_aref(options, sym("window")))) {
+            delete collector;
+            rb_raise(rb_eArgError, "aggregate can't be combined with window");
+        }
+        collector->aggregate = true;
+    }
+    if (RTEST(rb_hash_aref(options, sym("native")))) {
+        if (mode != sym("wall") && mode != sym("cpu")) {
+            delete collector;
+            rb_raise(rb_eArgError, "native is only supported in wall and cpu modes");
+        }
+#if HAVE_NATIVE_STACKS
+        collector->native = true;
+#else
+        delete collector;
+        rb_raise(rb_eNotImpError, "native stacks are only supported on x86_64 and arm64 Linux");
+#endif
+    }
+    VALUE obj = TypedData_Wrap_Struct(self, &rb_collector_type, collector);
+    rb_funcall(obj, rb_intern("initialize"), 2, mode, options);
+    return obj;
+}
+
+// Streams a Vernier::Result to an IO as Firefox Profiler "processed profile"
+// JSON, without first building the whole document out of Ruby Hashes and
+// Arrays. Vernier::Output::Firefox#output is the reference for the format;
+// this writes the same document and is handed the parts that are computed in
+// Ruby: the meta section and each func's category.
+//
+// Columns are read directly from the result, which is cheapest when it was
+// collected with packed: true.
+class GeckoWriter {
+    public:
+        GeckoWriter(VALUE io) : io(io) {
+            buffer.reserve(FLUSH_SIZE * 2);
+        }
+
+        // Ruby errors long jump, which would skip the destructors of the
+        // writer and everything it has on the stack. Calls into Ruby which
+        // can raise go through protect, which throws the error as a
+        // RubyError instead, for firefox_write_stream to raise again once
+        // the writer is gone.
+        struct RubyError {
+            int state;
+        };
+
+        void write(VALUE result, VALUE meta_json, VALUE func_categories, int gc_category, int thread_category, VALUE pid) {
+            this->result = result;
+            this->gc_category = gc_category;
+            this->thread_category = thread_category;
+            this->pid = pid;
+
+            VALUE stack_table = rb_ivar_get(result, rb_intern("@stack_table"));
+            VALUE frame_table = rb_ivar_get(result, rb_intern("@frame_table"));
+            VALUE func_table = rb_ivar_get(result, rb_intern("@func_table"));
+
+            IntColumn stack_parents(hash_get(stack_table, "parent"));
+            IntColumn stack_frames(hash_get(stack_table, "frame"));
+            IntColumn frame_funcs(hash_get(frame_table, "func"));
+            IntColumn frame_lines(hash_get(frame_table, "line"));
+            IntColumn func_first_lines(hash_get(func_table, "first_line"));
+            IntColumn func_category_list(func_categories);
+            VALUE func_names = hash_get(func_table, "name");
+            VALUE func_filenames = hash_get(func_table, "filename");
+
+            Tables tables = {
+                stack_parents, stack_frames,
+                frame_funcs, frame_lines,
+                func_first_lines, func_category_list
+            };
+            build_shared_strings(tables, func_names, func_filenames);
+
+            VALUE markers = rb_ivar_get(result, rb_intern("@markers"));
+            group_markers(markers);
+
+            VALUE threads = rb_ivar_get(result, rb_intern("@threads"));
+            std::vector<std::pair<VALUE, VALUE>> thread_list;
+            protect([&] {
+                Check_Type(threads, T_HASH);
+                rb_hash_foreach(threads, collect_pair_i, (VALUE)&thread_list);
+            });
+
+            append("{\"meta\":");
+            append(RSTRING_PTR(meta_json), RSTRING_LEN(meta_json));
+            append(",\"libs\":[],\"threads\":[");
+            for (size_t i = 0; i < thread_list.size(); i++) {
+                if (i) append(',');
+                write_thread(tables, thread_list[i].first, thread_list[i].second, thread_list.size(), markers);
+            }
+            append("]}");
+            flush();
+
+            RB_GC_GUARD(stack_table);
+            RB_GC_GUARD(frame_table);
+            RB_GC_GUARD(func_table);
+            RB_GC_GUARD(threads);
+        }
+
+    private:
+        static constexpr size_t FLUSH_SIZE = 64 * 1024;
+
+        VALUE io;
+        VALUE result;
+        VALUE pid;
+        int gc_category;
+        int thread_category;
+        std::string buffer;
+
+        template <typename F>
+        static VALUE protect_i(VALUE arg) {
+            (*reinterpret_cast<const F *>(arg))();
+            return Qnil;
+        }
+
+        template <typename F>
+        static void protect(const F &f) {
+            int state = 0;
+            rb_protect(protect_i<F>, reinterpret_cast<VALUE>(&f), &state);
+            if (state) throw RubyError{state};
+        }
 
-static const rb_data_type_t rb_collector_type = {
-    .wrap_struct_name = "vernier/collector",
-    .function = {
-        //.dmemsize = rb_collector_memsize,
-        .dmark = collector_mark,
-        .dfree = collector_free,
-    },
+        static void raise_error(VALUE klass, const char *message) {
+            protect([&] { rb_raise(klass, "%s", message); });
+        }
+
+        static VALUE hash_get(VALUE hash, const char *key) {
+            VALUE value;
+            protect([&] {
+                Check_Type(hash, T_HASH);
+                value = rb_hash_aref(hash, sym(key));
+            });
+            return value;
+        }
+
+        // Fixnums, which almost every value is, are converted without
+        // needing protect
+        static int32_t to_int(VALUE v) {
+            if (FIXNUM_P(v) && FIX2LONG(v) >= INT32_MIN && FIX2LONG(v) <= INT32_MAX) {
+                return FIX2LONG(v);
+            }
+            int32_t value;
+            protect([&] { value = NUM2INT(v); });
+            return value;
+        }
+
+        static uint64_t to_ull(VALUE v) {
+            if (FIXNUM_P(v) && FIX2LONG(v) >= 0) {
+                return FIX2LONG(v);
+            }
+            uint64_t value;
+            protect([&] { value = NUM2ULL(v); });
+            return value;
+        }
+
+        // A read-only view of a result column, either an Array or a packed
+        // String (see int_column). nil entries read as -1, as in packed form.
+        template <typename T>
+        class Column {
+            VALUE value;
+            const T *packed = NULL;
+            long len = 0;
+
+            static T convert(VALUE v);
+
+            public:
+            Column(VALUE value) : value(value) {
+                if (NIL_P(value)) return;
+
+                if (RB_TYPE_P(value, T_STRING)) {
+                    packed = reinterpret_cast<const T *>(RSTRING_PTR(value));
+                    len = RSTRING_LEN(value) / sizeof(T);
+                } else {
+                    protect([&] { Check_Type(value, T_ARRAY); });
+                    len = RARRAY_LEN(value);
+                }
+            }
+
+            bool present() const {
+                return !NIL_P(value);
+            }
+
+            long size() const {
+                return len;
+            }
+
+            T operator[](long i) const {
+                if (packed) return packed[i];
+                return convert(RARRAY_AREF(value, i));
+            }
+        };
+        typedef Column<int32_t> IntColumn;
+        typedef Column<uint64_t> TimeColumn;
+
+        struct Tables {
+            IntColumn &stack_parents;
+            IntColumn &stack_frames;
+            IntColumn &frame_funcs;
+            IntColumn &frame_lines;
+            IntColumn &func_first_lines;
+            IntColumn &func_categories;
+        };
+
+        // The string table every thread starts with, in the order the Ruby
+        // output interns them: func names, filenames, frame implementations,
+        // then "<cfunc>". Marker names are added per thread after these.
+        std::vector<std::string> shared_strings;
+        std::unordered_map<std::string, int> shared_string_idx;
+        std::vector<int> func_name_idx;
+        std::vector<int> func_filename_idx;
+        std::vector<int> frame_implementation_idx;
+        int cfunc_idx;
+
+        struct ThreadStrings {
+            const GeckoWriter &writer;
+            std::vector<std::string> extra;
+            std::unordered_map<std::string, int> extra_idx;
+
+            int index(const std::string &str) {
+                auto it = writer.shared_string_idx.find(str);
+                if (it != writer.shared_string_idx.end()) return it->second;
+
+                auto extra_it = extra_idx.find(str);
+                if (extra_it != extra_idx.end()) return extra_it->second;
+
+                int idx = writer.shared_strings.size() + extra.size();
+                extra.push_back(str);
+                extra_idx[str] = idx;
+                return idx;
+            }
+        };
+
+        int shared_string_index(const std::string &str) {
+            auto it = shared_string_idx.find(str);
+            if (it != shared_string_idx.end()) return it->second;
+
+            int idx = shared_strings.size();
+            shared_strings.push_back(str);
+            shared_string_idx[str] = idx;
+            return idx;
+        }
+
+        static std::string ruby_string(VALUE str) {
+            protect([&] { str = rb_obj_as_string(str); });
+            return std::string(RSTRING_PTR(str), RSTRING_LEN(str));
+        }
+
+        void build_shared_strings(Tables &tables, VALUE names, VALUE filenames) {
+            protect([&] {
+                Check_Type(names, T_ARRAY);
+                Check_Type(filenames, T_ARRAY);
+            });
+            long func_count = RARRAY_LEN(names);
+            for (long i = 0; i < func_count; i++) {
+                func_name_idx.push_back(shared_string_index(ruby_string(RARRAY_AREF(names, i))));
+            }
+            std::vector<bool> func_is_cfunc;
+            for (long i = 0; i < func_count; i++) {
+                std::string filename = ruby_string(RARRAY_AREF(filenames, i));
+                func_filename_idx.push_back(shared_string_index(filename));
+                func_is_cfunc.push_back(filename == "<cfunc>");
+            }
+
+            // Must match strings in `src/profile-logic/profile-data.js`
+            // inside the firefox profiler. See `getFriendlyStackTypeName`
+            for (long i = 0; i < tables.frame_funcs.size(); i++) {
+                if (func_is_cfunc[tables.frame_funcs[i]]) {
+                    frame_implementation_idx.push_back(shared_string_index("native"));
+                } else if (tables.frame_lines[i] == -1) {
+                    frame_implementation_idx.push_back(shared_string_index("yjit"));
+                } else {
+                    // interpreter
+                    frame_implementation_idx.push_back(-1);
+                }
+            }
+
+            cfunc_idx = shared_string_index("<cfunc>");
+        }
+
+        // Marker indexes for each thread id. Thread ids are almost always
+        // Integers, but markers added from Ruby could use anything.
+        std::unordered_map<VALUE, std::vector<long>> fixnum_markers;
+        std::vector<std::pair<VALUE, std::vector<long>>> other_markers;
+
+        std::vector<long> *markers_for(VALUE thread_id, bool create) {
+            if (FIXNUM_P(thread_id)) {
+                auto it = fixnum_markers.find(thread_id);
+                if (it != fixnum_markers.end()) return &it->second;
+                return create ? &fixnum_markers[thread_id] : NULL;
+            }
+
+            for (auto &entry : other_markers) {
+                bool eql;
+                protect([&] { eql = rb_eql(entry.first, thread_id); });
+                if (eql) return &entry.second;
+            }
+            if (!create) return NULL;
+            other_markers.emplace_back(thread_id, std::vector<long>());
+            return &other_markers.back().second;
+        }
+
+        void group_markers(VALUE markers) {
+            if (NIL_P(markers)) return;
+
+            for (long i = 0; i < RARRAY_LEN(markers); i++) {
+                VALUE marker = RARRAY_AREF(markers, i);
+                markers_for(RARRAY_AREF(marker, 0), true)->push_back(i);
+            }
+        }
+
+        static int collect_pair_i(VALUE key, VALUE value, VALUE arg) {
+            auto *list = reinterpret_cast<std::vector<std::pair<VALUE, VALUE>> *>(arg);
+            list->emplace_back(key, value);
+            return ST_CONTINUE;
+        }
+
+        void write_thread(Tables &tables, VALUE ruby_thread_id, VALUE thread, size_t thread_count, VALUE markers) {
+            VALUE name = hash_get(thread, "name");
+            VALUE tid = hash_get(thread, "tid");
+            VALUE started_at = hash_get(thread, "started_at");
+            VALUE stopped_at = hash_get(thread, "stopped_at");
+
+            IntColumn samples(hash_get(thread, "samples"));
+            IntColumn weights(hash_get(thread, "weights"));
+            TimeColumn timestamps(hash_get(thread, "timestamps"));
+            IntColumn sample_categories(hash_get(thread, "sample_categories"));
+
+            ThreadStrings strings{*this, {}, {}};
+
+            bool main_thread = thread_count == 1;
+            if (!main_thread) {
+                protect([&] { main_thread = rb_equal(ruby_thread_id, rb_obj_id(rb_thread_main())); });
+            }
+
+            append("{\"name\":");
+            append_string(ruby_string(name));
+            append(",\"isMainThread\":");
+            append(main_thread ? "true" : "false");
+            append(",\"processStartupTime\":0,\"processShutdownTime\":null");
+            append(",\"registerTime\":");
+            append_time(to_ull(started_at));
+            append(",\"unregisterTime\":");
+            if (NIL_P(stopped_at)) {
+                append("null");
+            } else {
+                append_time(to_ull(stopped_at));
+            }
+            // Merged results say which process each thread came from
+            VALUE thread_pid = hash_get(thread, "pid");
+            append(",\"pausedRanges\":[],\"pid\":");
+            append_integer(NIL_P(thread_pid) ? pid : thread_pid);
+            append(",\"tid\":");
+            append_integer(tid);
+
+            long frame_count = tables.frame_funcs.size();
+            append(",\"frameTable\":{\"address\":");
+            append_repeated("-1", frame_count);
+            append(",\"inlineDepth\":");
+            append_repeated("0", frame_count);
+            append(",\"category\":[");
+            for (long i = 0; i < frame_count; i++) {
+                if (i) append(',');
+                append_int(tables.func_categories[tables.frame_funcs[i]]);
+            }
+            append("],\"subcategory\":null,\"func\":");
+            append_column(tables.frame_funcs);
+            append(",\"nativeSymbol\":");
+            append_repeated("null", frame_count);
+            append(",\"innerWindowID\":");
+            append_repeated("null", frame_count);
+            append(",\"implementation\":");
+            append_index_list(frame_implementation_idx);
+            append(",\"line\":");
+            append_column(tables.frame_lines);
+            append(",\"column\":");
+            append_repeated("null", frame_count);
+            append(",\"length\":");
+            append_int(frame_count);
+            append('}');
+
+            long func_count = func_name_idx.size();
+            append(",\"funcTable\":{\"name\":");
+            append_index_list(func_name_idx);
+            for (const char *key : {",\"isJS\":[", ",\"relevantForJS\":["}) {
+                append(key);
+                for (long i = 0; i < func_count; i++) {
+                    if (i) append(',');
+                    append(func_filename_idx[i] != cfunc_idx ? "true" : "false");
+                }
+                append(']');
+            }
+            append(",\"resource\":");
+            append_repeated("-1", func_count);
+            append(",\"fileName\":");
+            append_index_list(func_filename_idx);
+            append(",\"lineNumber\":");
+            append_column(tables.func_first_lines);
+            append(",\"columnNumber\":");
+            append_repeated("0", func_count);
+            append(",\"length\":");
+            append_int(func_count);
+            append('}');
+
+            append(",\"nativeSymbols\":{}");
+
+            // Samples which aren't in the default category get a copy of
+            // their stack carrying that category, appended to the stack table
+            long sample_count = samples.size();
+            long stack_count = tables.stack_frames.size();
+            if (weights.size() != sample_count) raise_error(rb_eRuntimeError, "weights don't match samples");
+            if (timestamps.present() && timestamps.size() != sample_count) raise_error(rb_eRuntimeError, "timestamps don't match samples");
+
+            std::unordered_map<uint64_t, int> categorized_stack_idx;
+            std::vector<std::pair<int, int>> categorized_stacks;
+
+            append(",\"samples\":{\"stack\":[");
+            for (long i = 0; i < sample_count; i++) {
+                if (i) append(',');
+                int stack = samples[i];
+                int category = (sample_categories.present() && sample_categories.size() > 0) ? sample_categories[i] : 0;
+                if (category != 0) {
+                    uint64_t key = ((uint64_t)(uint32_t)stack << 32) | (uint32_t)category;
+                    auto it = categorized_stack_idx.find(key);
+                    if (it == categorized_stack_idx.end()) {
+                        int idx = stack_count + categorized_stacks.size();
+                        categorized_stacks.emplace_back(stack, category);
+                        it = categorized_stack_idx.insert({key, idx}).first;
+                    }
+                    stack = it->second;
+                }
+                append_int(stack);
+            }
+            append("],\"time\":[");
+            for (long i = 0; i < sample_count; i++) {
+                if (i) append(',');
+                append_time(timestamps.present() ? timestamps[i] : 0);
+            }
+            append("],\"weight\":");
+            append_column(weights);
+            append(",\"weightType\":\"samples\",\"length\":");
+            append_int(sample_count);
+            append('}');
+
+            long total_stacks = stack_count + categorized_stacks.size();
+            append(",\"stackTable\":{\"frame\":[");
+            for (long i = 0; i < total_stacks; i++) {
+                if (i) append(',');
+                int stack = i < stack_count ? i : categorized_stacks[i - stack_count].first;
+                append_int(tables.stack_frames[stack]);
+            }
+            append("],\"category\":[");
+            for (long i = 0; i < total_stacks; i++) {
+                if (i) append(',');
+                if (i < stack_count) {
+                    append_int(tables.func_categories[tables.frame_funcs[tables.stack_frames[i]]]);
+                } else {
+                    append_int(categorized_stacks[i - stack_count].second);
+                }
+            }
+            append("],\"subcategory\":");
+            append_repeated("0", total_stacks);
+            append(",\"prefix\":[");
+            for (long i = 0; i < total_stacks; i++) {
+                if (i) append(',');
+                int stack = i < stack_count ? i : categorized_stacks[i - stack_count].first;
+                int parent = tables.stack_parents[stack];
+                if (parent < 0) {
+                    append("null");
+                } else {
+                    append_int(parent);
+                }
+            }
+            append("],\"length\":");
+            append_int(total_stacks);
+            append('}');
+
+            append(",\"resourceTable\":{\"length\":0,\"lib\":[],\"name\":[],\"host\":[],\"type\":[]}");
+
+            write_markers(markers, markers_for(ruby_thread_id, false), strings);
+
+            append(",\"stringArray\":[");
+            for (size_t i = 0; i < shared_strings.size(); i++) {
+                if (i) append(',');
+                append_string(shared_strings[i]);
+            }
+            for (const auto &str : strings.extra) {
+                append(',');
+                append_string(str);
+            }
+            append("]}");
+
+            RB_GC_GUARD(thread);
+        }
+
+        void write_markers(VALUE markers, const std::vector<long> *indexes, ThreadStrings &strings) {
+            static const std::vector<long> none;
+            if (!indexes) indexes = &none;
+
+            std::vector<int> names;
+            std::vector<int> categories;
+            for (long idx : *indexes) {
+                VALUE marker = RARRAY_AREF(markers, idx);
+                std::string name = ruby_string(RARRAY_AREF(marker, 1));
+                names.push_back(strings.index(name));
+
+                if (name.compare(0, 2, "GC") == 0) {
+                    categories.push_back(gc_category);
+                } else if (name.compare(0, 6, "Thread") == 0) {
+                    categories.push_back(thread_category);
+                } else {
+                    categories.push_back(0);
+                }
+            }
+
+            VALUE json;
+            protect([&] { json = rb_const_get(rb_cObject, rb_intern("JSON")); });
+            append(",\"markers\":{\"data\":[");
+            for (size_t i = 0; i < indexes->size(); i++) {
+                if (i) append(',');
+                VALUE datum = RARRAY_AREF(RARRAY_AREF(markers, (*indexes)[i]), 5);
+                if (NIL_P(datum)) {
+                    append("null");
+                } else {
+                    VALUE generated;
+                    protect([&] { generated = rb_String(rb_funcall(json, rb_intern("generate"), 1, datum)); });
+                    append(RSTRING_PTR(generated), RSTRING_LEN(generated));
+                }
+            }
+            append("],\"name\":");
+            append_index_list(names);
+            append(",\"startTime\":[");
+            for (size_t i = 0; i < indexes->size(); i++) {
+                if (i) append(',');
+                append_time(to_ull(RARRAY_AREF(RARRAY_AREF(markers, (*indexes)[i]), 2)));
+            }
+            append("],\"endTime\":[");
+            for (size_t i = 0; i < indexes->size(); i++) {
+                if (i) append(',');
+                VALUE finish = RARRAY_AREF(RARRAY_AREF(markers, (*indexes)[i]), 3);
+                if (NIL_P(finish)) {
+                    append("null");
+                } else {
+                    append_time(to_ull(finish));
+                }
+            }
+            append("],\"phase\":[");
+            for (size_t i = 0; i < indexes->size(); i++) {
+                if (i) append(',');
+                append_int(to_int(RARRAY_AREF(RARRAY_AREF(markers, (*indexes)[i]), 4)));
+            }
+            append("],\"category\":");
+            append_index_list(categories);
+            append(",\"length\":");
+            append_int(indexes->size());
+            append('}');
+        }
+
+        void flush() {
+            if (buffer.empty()) return;
+            protect([&] { rb_io_write(io, rb_str_new(buffer.data(), buffer.size())); });
+            buffer.clear();
+        }
+
+        void append(char c) {
+            buffer.push_back(c);
+        }
+
+        void append(const char *str) {
+            buffer.append(str);
+            if (buffer.size() >= FLUSH_SIZE) flush();
+        }
+
+        void append(const char *str, size_t len) {
+            buffer.append(str, len);
+            if (buffer.size() >= FLUSH_SIZE) flush();
+        }
+
+        void append_int(long long value) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%lld", value);
+            append(buf, len);
+        }
+
+        void append_integer(VALUE value) {
+            if (FIXNUM_P(value)) {
+                append_int(FIX2LONG(value));
+            } else {
+                std::string str = ruby_string(value);
+                append(str.data(), str.size());
+            }
+        }
+
+        // Nanoseconds to milliseconds as a JSON number, using the shortest
+        // representation which round trips (JSON.generate does the same)
+        void append_time(uint64_t ns) {
+            double ms = ns / 1000000.0;
+
+            char buf[32];
+            int len = 0;
+            for (int precision = 15; precision <= 17; precision++) {
+                len = snprintf(buf, sizeof(buf), "%.*g", precision, ms);
+                if (strtod(buf, NULL) == ms) break;
+            }
+            append(buf, len);
+            if (!strpbrk(buf, ".e")) append(".0");
+        }
+
+        void append_string(const std::string &str) {
+            append('"');
+            for (unsigned char c : str) {
+                switch (c) {
+                    case '"': buffer.append("\\\""); break;
+                    case '\\': buffer.append("\\\\"); break;
+                    case '\b': buffer.append("\\b"); break;
+                    case '\f': buffer.append("\\f"); break;
+                    case '\n': buffer.append("\\n"); break;
+                    case '\r': buffer.append("\\r"); break;
+                    case '\t': buffer.append("\\t"); break;
+                    default:
+                        if (c < 0x20) {
+                            char buf[8];
+                            snprintf(buf, sizeof(buf), "\\u%04x", c);
+                            buffer.append(buf);
+                        } else {
+                            buffer.push_back(c);
+                        }
+                }
+            }
+            append("\"");
+        }
+
+        void append_repeated(const char *value, long count) {
+            append('[');
+            for (long i = 0; i < count; i++) {
+                if (i) append(',');
+                append(value);
+            }
+            append(']');
+        }
+
+        template <typename T>
+        void append_column(const Column<T> &column) {
+            append('[');
+            for (long i = 0; i < column.size(); i++) {
+                if (i) append(',');
+                append_int(column[i]);
+            }
+            append(']');
+        }
+
+        // Indexes into the string table, with -1 written as null
+        void append_index_list(const std::vector<int> &list) {
+            append('[');
+            for (size_t i = 0; i < list.size(); i++) {
+                if (i) append(',');
+                if (list[i] < 0) {
+                    append("null");
+                } else {
+                    append_int(list[i]);
+                }
+            }
+            append(']');
+        }
 };
 
-static BaseCollector *get_collector(VALUE obj) {
-    BaseCollector *collector;
-    TypedData_Get_Struct(obj, BaseCollector, &rb_collector_type, collector);
-    return collector;
+template <>
+int32_t GeckoWriter::Column<int32_t>::convert(VALUE v) {
+    return NIL_P(v) ? -1 : to_int(v);
+}
+
+template <>
+uint64_t GeckoWriter::Column<uint64_t>::convert(VALUE v) {
+    return to_ull(v);
 }
 
 static VALUE
-collector_start(VALUE self) {
-    auto *collector = get_collector(self);
+firefox_write_stream(VALUE, VALUE io, VALUE result, VALUE meta_json, VALUE func_categories, VALUE gc_category, VALUE thread_category, VALUE pid) {
+    StringValue(meta_json);
+    int gc = NUM2INT(gc_category);
+    int thread = NUM2INT(thread_category);
 
-    if (!collector->start()) {
-        rb_raise(rb_eRuntimeError, "already running");
+    int state = 0;
+    {
+        GeckoWriter writer(io);
+        try {
+            writer.write(result, meta_json, func_categories, gc, thread, pid);
+        } catch (const GeckoWriter::RubyError &error) {
+            state = error.state;
+        }
     }
+    if (state) rb_jump_tag(state);
 
-    return Qtrue;
+    return io;
 }
 
+// Merges results from several processes, eg. the workers of a forking server,
+// into one. Identical funcs, frames and stacks are shared, so the merged
+// tables are a union of the inputs', and each result's samples and marker
+// stacks are remapped into them. Threads keep their keys unless another
+// result already used the same one (forked children inherit the parent's
+// object ids), in which case the key becomes [pid, key]. Every thread is
+// tagged with the pid of the result it came from.
+class ResultMerger {
+    public:
+        ResultMerger() {
+            func_names = rb_ary_new();
+            func_filenames = rb_ary_new();
+            threads = rb_hash_new();
+            markers = rb_ary_new();
+        }
+
+        void add(VALUE result) {
+            if (!rb_obj_is_kind_of(result, rb_cVernierResult)) {
+                rb_raise(rb_eTypeError, "expected a Vernier::Result");
+            }
+
+            VALUE pid = rb_funcall(result, rb_intern("pid"), 0);
+            if (NIL_P(first)) first = result;
+
+            VALUE end_time = rb_funcall(result, rb_intern("end_time"), 0);
+            if (!NIL_P(end_time) && (NIL_P(this->end_time) || NUM2ULL(end_time) > NUM2ULL(this->end_time))) {
+                this->end_time = end_time;
+            }
+            VALUE meta = rb_funcall(result, rb_intern("meta"), 0);
+            VALUE started_at = NIL_P(meta) ? Qnil : rb_hash_aref(meta, sym("started_at"));
+            if (!NIL_P(started_at) && (NIL_P(this->started_at) || NUM2ULL(started_at) < NUM2ULL(this->started_at))) {
+                this->started_at = started_at;
+            }
+
+            std::vector<int> func_remap = add_funcs(rb_funcall(result, rb_intern("func_table"), 0));
+            std::vector<int> frame_remap = add_frames(rb_funcall(result, rb_intern("frame_table"), 0), func_remap);
+            std::vector<int> stack_remap = add_stacks(rb_funcall(result, rb_intern("stack_table"), 0), frame_remap);
+
+            VALUE thread_keys = add_threads(rb_funcall(result, rb_intern("threads"), 0), stack_remap, pid);
+            add_markers(rb_funcall(result, rb_intern("markers"), 0), stack_remap, thread_keys);
+        }
+
+        VALUE finish() {
+            VALUE result = rb_obj_alloc(rb_cVernierResult);
+
+            VALUE stack_table = rb_hash_new();
+            rb_hash_aset(stack_table, sym("parent"), int_column(stack_parents, false, true));
+            rb_hash_aset(stack_table, sym("frame"), int_column(stack_frames, false));
+            rb_ivar_set(result, rb_intern("@stack_table"), stack_table);
+
+            VALUE frame_table = rb_hash_new();
+            rb_hash_aset(frame_table, sym("func"), int_column(frame_funcs, false));
+            rb_hash_aset(frame_table, sym("line"), int_column(frame_lines, false));
+            rb_ivar_set(result, rb_intern("@frame_table"), frame_table);
+
+            VALUE func_table = rb_hash_new();
+            rb_hash_aset(func_table, sym("name"), func_names);
+            rb_hash_aset(func_table, sym("filename"), func_filenames);
+            rb_hash_aset(func_table, sym("first_line"), int_column(func_first_lines, false));
+            rb_ivar_set(result, rb_intern("@func_table"), func_table);
+
+            rb_ivar_set(result, rb_intern("@threads"), threads);
+            rb_ivar_set(result, rb_intern("@markers"), markers);
+
+            // Stats and chunk positions describe a single collector, so
+            // only the rest of the first result's meta is kept
+            VALUE meta = rb_hash_new();
+            if (!NIL_P(first)) {
+                VALUE first_meta = rb_funcall(first, rb_intern("meta"), 0);
+                if (!NIL_P(first_meta)) meta = rb_hash_dup(first_meta);
+                rb_hash_delete(meta, sym("profiler"));
+                rb_hash_delete(meta, sym("chunk"));
+                rb_ivar_set(result, rb_intern("@pid"), rb_funcall(first, rb_intern("pid"), 0));
+            }
+            if (!NIL_P(started_at)) rb_hash_aset(meta, sym("started_at"), started_at);
+            rb_ivar_set(result, rb_intern("@meta"), meta);
+            rb_ivar_set(result, rb_intern("@end_time"), end_time);
+
+            return result;
+        }
+
+    private:
+        VALUE first = Qnil;
+        VALUE started_at = Qnil;
+        VALUE end_time = Qnil;
+
+        std::vector<int32_t> stack_parents;
+        std::vector<int32_t> stack_frames;
+        std::vector<int32_t> frame_funcs;
+        std::vector<int32_t> frame_lines;
+        std::vector<int32_t> func_first_lines;
+        VALUE func_names;
+        VALUE func_filenames;
+        VALUE threads;
+        VALUE markers;
+
+        // Funcs are identified by name, filename and first line, separated
+        // by NULs
+        std::unordered_map<std::string, int> func_index;
+        std::unordered_map<uint64_t, int> frame_index;
+        std::unordered_map<uint64_t, int> stack_index;
+
+        static uint64_t pair_key(int a, int b) {
+            return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+        }
+
+        static int remap_index(const std::vector<int> &remap, VALUE index) {
+            long idx = NUM2LONG(index);
+            if (idx < 0 || (size_t)idx >= remap.size()) rb_raise(rb_eArgError, "index %ld out of range", idx);
+            return remap[idx];
+        }
+
+        static VALUE column(VALUE table, const char *name) {
+            VALUE column = rb_hash_aref(table, ID2SYM(rb_intern(name)));
+            Check_Type(column, T_ARRAY);
+            return column;
+        }
+
+        std::vector<int> add_funcs(VALUE func_table) {
+            VALUE names = column(func_table, "name");
+            VALUE filenames = column(func_table, "filename");
+            VALUE first_lines = column(func_table, "first_line");
+
+            std::vector<int> remap(RARRAY_LEN(names));
+            for (long i = 0; i < RARRAY_LEN(names); i++) {
+                VALUE name = rb_obj_as_string(RARRAY_AREF(names, i));
+                VALUE filename = rb_obj_as_string(RARRAY_AREF(filenames, i));
+                int first_line = NUM2INT(RARRAY_AREF(first_lines, i));
+
+                std::string key(RSTRING_PTR(name), RSTRING_LEN(name));
+                key.push_back('\0');
+                key.append(RSTRING_PTR(filename), RSTRING_LEN(filename));
+                key.push_back('\0');
+                key.append(std::to_string(first_line));
+
+                auto inserted = func_index.emplace(key, (int)func_first_lines.size());
+                if (inserted.second) {
+                    rb_ary_push(func_names, name);
+                    rb_ary_push(func_filenames, filename);
+                    func_first_lines.push_back(first_line);
+                }
+                remap[i] = inserted.first->second;
+            }
+            return remap;
+        }
+
+        std::vector<int> add_frames(VALUE frame_table, const std::vector<int> &func_remap) {
+            VALUE funcs = column(frame_table, "func");
+            VALUE lines = column(frame_table, "line");
+
+            std::vector<int> remap(RARRAY_LEN(funcs));
+            for (long i = 0; i < RARRAY_LEN(funcs); i++) {
+                int func = remap_index(func_remap, RARRAY_AREF(funcs, i));
+                int line = NUM2INT(RARRAY_AREF(lines, i));
+
+                auto inserted = frame_index.emplace(pair_key(func, line), (int)frame_funcs.size());
+                if (inserted.second) {
+                    frame_funcs.push_back(func);
+                    frame_lines.push_back(line);
+                }
+                remap[i] = inserted.first->second;
+            }
+            return remap;
+        }
+
+        // Parents always come before their children, so each stack's
+        // parent has already been remapped
+        std::vector<int> add_stacks(VALUE stack_table, const std::vector<int> &frame_remap) {
+            VALUE parents = column(stack_table, "parent");
+            VALUE frames = column(stack_table, "frame");
+
+            std::vector<int> remap(RARRAY_LEN(frames));
+            for (long i = 0; i < RARRAY_LEN(frames); i++) {
+                VALUE parentv = RARRAY_AREF(parents, i);
+                int parent = -1;
+                if (!NIL_P(parentv)) {
+                    int old_parent = NUM2INT(parentv);
+                    if (old_parent < 0 || old_parent >= i) rb_raise(rb_eArgError, "stack parent out of order");
+                    parent = remap[old_parent];
+                }
+                int frame = remap_index(frame_remap, RARRAY_AREF(frames, i));
+
+                auto inserted = stack_index.emplace(pair_key(parent, frame), (int)stack_frames.size());
+                if (inserted.second) {
+                    stack_parents.push_back(parent);
+                    stack_frames.push_back(frame);
+                }
+                remap[i] = inserted.first->second;
+            }
+            return remap;
+        }
+
+        static int collect_pair_i(VALUE key, VALUE value, VALUE arg) {
+            auto *list = reinterpret_cast<std::vector<std::pair<VALUE, VALUE>> *>(arg);
+            list->emplace_back(key, value);
+            return ST_CONTINUE;
+        }
+
+        // Returns the keys which had to change, old to new
+        VALUE add_threads(VALUE result_threads, const std::vector<int> &stack_remap, VALUE pid) {
+            VALUE thread_keys = rb_hash_new();
+            if (NIL_P(result_threads)) return thread_keys;
+
+            std::vector<std::pair<VALUE, VALUE>> thread_list;
+            rb_hash_foreach(result_threads, collect_pair_i, (VALUE)&thread_list);
+
+            for (auto &pair : thread_list) {
+                VALUE key = pair.first;
+                VALUE thread = rb_hash_dup(pair.second);
+
+                VALUE samples = rb_hash_aref(thread, sym("samples"));
+                Check_Type(samples, T_ARRAY);
+                VALUE remapped = rb_ary_new_capa(RARRAY_LEN(samples));
+                for (long i = 0; i < RARRAY_LEN(samples); i++) {
+                    rb_ary_push(remapped, INT2NUM(remap_index(stack_remap, RARRAY_AREF(samples, i))));
+                }
+                rb_hash_aset(thread, sym("samples"), remapped);
+
+                VALUE gvl = rb_hash_aref(thread, sym("gvl"));
+                if (!NIL_P(gvl)) {
+                    gvl = rb_hash_dup(gvl);
+                    VALUE stacks = rb_hash_aref(gvl, sym("stack"));
+                    Check_Type(stacks, T_ARRAY);
+                    VALUE remapped_stacks = rb_ary_new_capa(RARRAY_LEN(stacks));
+                    for (long i = 0; i < RARRAY_LEN(stacks); i++) {
+                        VALUE stack = RARRAY_AREF(stacks, i);
+                        rb_ary_push(remapped_stacks, NIL_P(stack) ? Qnil : INT2NUM(remap_index(stack_remap, stack)));
+                    }
+                    rb_hash_aset(gvl, sym("stack"), remapped_stacks);
+                    rb_hash_aset(thread, sym("gvl"), gvl);
+                }
+
+                if (NIL_P(rb_hash_aref(thread, sym("pid")))) {
+                    rb_hash_aset(thread, sym("pid"), pid);
+                }
+
+                if (rb_hash_lookup2(threads, key, Qundef) != Qundef) {
+                    VALUE new_key = rb_ary_new_from_args(2, pid, key);
+                    rb_hash_aset(thread_keys, key, new_key);
+                    key = new_key;
+                }
+                rb_hash_aset(threads, key, thread);
+            }
+            return thread_keys;
+        }
+
+        void add_markers(VALUE result_markers, const std::vector<int> &stack_remap, VALUE thread_keys) {
+            if (NIL_P(result_markers)) return;
+            Check_Type(result_markers, T_ARRAY);
+
+            for (long i = 0; i < RARRAY_LEN(result_markers); i++) {
+                VALUE marker = rb_ary_dup(RARRAY_AREF(result_markers, i));
+
+                VALUE new_key = rb_hash_lookup2(thread_keys, rb_ary_entry(marker, 0), Qundef);
+                if (new_key != Qundef) rb_ary_store(marker, 0, new_key);
+
+                VALUE data = rb_ary_entry(marker, 5);
+                VALUE cause = RB_TYPE_P(data, T_HASH) ? rb_hash_aref(data, sym("cause")) : Qnil;
+                VALUE stack = RB_TYPE_P(cause, T_HASH) ? rb_hash_aref(cause, sym("stack")) : Qnil;
+                if (FIXNUM_P(stack)) {
+                    cause = rb_hash_dup(cause);
+                    rb_hash_aset(cause, sym("stack"), INT2NUM(remap_index(stack_remap, stack)));
+                    data = rb_hash_dup(data);
+                    rb_hash_aset(data, sym("cause"), cause);
+                    rb_ary_store(marker, 5, data);
+                }
+
+                rb_ary_push(markers, marker);
+            }
+        }
+};
+
 static VALUE
-collector_stop(VALUE self) {
-    auto *collector = get_collector(self);
+result_merge(VALUE, VALUE results) {
+    Check_Type(results, T_ARRAY);
 
-    VALUE result = collector->stop();
-    return result;
+    ResultMerger merger;
+    for (long i = 0; i < RARRAY_LEN(results); i++) {
+        merger.add(RARRAY_AREF(results, i));
+    }
+    return merger.finish();
 }
 
 static VALUE
-markers(VALUE self) {
-    auto *collector = get_collector(self);
+collector_prepare_fork(VALUE self) {
+    get_collector(self)->prepare_fork();
+    return Qnil;
+}
 
-    return collector->get_markers();
+static VALUE
+collector_after_fork(VALUE self, VALUE child) {
+    return get_collector(self)->after_fork(RTEST(child)) ? Qtrue : Qfalse;
 }
 
 static VALUE
-collector_sample(VALUE self) {
-    auto *collector = get_collector(self);
+vernier_label_id(VALUE, VALUE base, VALUE labels) {
+    Check_Type(labels, T_HASH);
+    int base_id = NUM2INT(base);
+    if (!LabelTable::instance().valid(base_id)) {
+        rb_raise(rb_eArgError, "unknown label id %d", base_id);
+    }
+    return INT2NUM(LabelTable::instance().intern(base_id, labels));
+}
 
-    collector->sample();
-    return Qtrue;
+static VALUE
+vernier_current_label_id(VALUE) {
+    return INT2NUM(current_label_id);
 }
 
-static VALUE collector_new(VALUE self, VALUE mode, VALUE options) {
-    BaseCollector *collector;
-    if (mode == sym("retained")) {
-        collector = new RetainedCollector();
-    } else if (mode == sym("custom")) {
-        collector = new CustomCollector();
-    } else if (mode == sym("wall")) {
-        VALUE intervalv = rb_hash_aref(options, sym("interval"));
-        TimeStamp interval;
-        if (NIL_P(intervalv)) {
-            interval = TimeStamp::from_microseconds(500);
-        } else {
-            interval = TimeStamp::from_microseconds(NUM2UINT(intervalv));
-        }
-        collector = new TimeCollector(interval);
-    } else {
-        rb_raise(rb_eArgError, "invalid mode");
+static VALUE
+vernier_set_current_label_id(VALUE, VALUE id) {
+    int label_id = NUM2INT(id);
+    if (!LabelTable::instance().valid(label_id)) {
+        rb_raise(rb_eArgError, "unknown label id %d", label_id);
     }
-    VALUE obj = TypedData_Wrap_Struct(self, &rb_collector_type, collector);
-    rb_funcall(obj, rb_intern("initialize"), 1, mode);
-    return obj;
+    current_label_id = label_id;
+    return id;
 }
 
 static void
@@ -1652,6 +6179,9 @@ Init_consts(VALUE rb_mVernierMarkerPhase) {
     MARKER_CONST(THREAD_STALLED);
     MARKER_CONST(THREAD_SUSPENDED);
 
+    MARKER_CONST(PROFILER_LATE_TICK);
+    MARKER_CONST(PROFILER_SLOW_TICK);
+
 #undef MARKER_CONST
 
 #define PHASE_CONST(name) \
@@ -1676,13 +6206,29 @@ Init_vernier(void)
   rb_cVernierCollector = rb_define_class_under(rb_mVernier, "Collector", rb_cObject);
   rb_undef_alloc_func(rb_cVernierCollector);
   rb_define_singleton_method(rb_cVernierCollector, "_new", collector_new, 2);
-  rb_define_method(rb_cVernierCollector, "start", collector_start, 0);
+  rb_define_private_method(rb_cVernierCollector, "start_collection", collector_start, 0);
   rb_define_method(rb_cVernierCollector, "sample", collector_sample, 0);
   rb_define_private_method(rb_cVernierCollector, "finish",  collector_stop, 0);
+  rb_define_private_method(rb_cVernierCollector, "flush_chunk",  collector_flush, 0);
+  rb_define_private_method(rb_cVernierCollector, "dump_window",  collector_dump, 0);
   rb_define_private_method(rb_cVernierCollector, "markers",  markers, 0);
+  rb_define_private_method(rb_cVernierCollector, "prepare_fork",  collector_prepare_fork, 0);
+  rb_define_private_method(rb_cVernierCollector, "fork_finished",  collector_after_fork, 1);
+
+  rb_define_singleton_method(rb_cVernierResult, "merge", result_merge, 1);
+
+  rb_define_singleton_method(rb_mVernier, "_label_id", vernier_label_id, 2);
+  rb_define_singleton_method(rb_mVernier, "_current_label_id", vernier_current_label_id, 0);
+  rb_define_singleton_method(rb_mVernier, "_current_label_id=", vernier_set_current_label_id, 1);
+
+  VALUE rb_mVernierOutput = rb_define_module_under(rb_mVernier, "Output");
+  VALUE rb_cVernierOutputFirefox = rb_define_class_under(rb_mVernierOutput, "Firefox", rb_cObject);
+  rb_define_private_method(rb_cVernierOutputFirefox, "write_stream", firefox_write_stream, 7);
 
   Init_consts(rb_mVernierMarkerPhase);
 
+  TimeCollector::init_symbolicate_job();
+
   //static VALUE gc_hook = Data_Wrap_Struct(rb_cObject, collector_mark, NULL, &_collector);
   //rb_global_variable(&gc_hook);
 }
@@ -6,12 +6,14 @@ require_relative "vernier/result"
 require_relative "vernier/vernier"
 require_relative "vernier/output/firefox"
 require_relative "vernier/output/top"
+require_relative "vernier/output/folded"
+require_relative "vernier/fork_hooks"
 
 module Vernier
   class Error < StandardError; end
 
-  def self.trace(mode: :wall, out: nil, interval: nil)
-    collector = Vernier::Collector.new(mode, { interval: })
+  def self.trace(mode: :wall, out: nil, interval: nil, **options)
+    collector = Vernier::Collector.new(mode, { interval:, **options })
     collector.start
 
     result = nil
@@ -20,7 +22,7 @@ module Vernier
     ensure
       result = collector.stop
       if out
-        File.write(out, Output::Firefox.new(result).output)
+        result.write(out:)
       end
     end
 
@@ -46,6 +48,21 @@ module Vernier
     result
   end
 
+  # Labels the samples taken on the current thread while the block runs,
+  # keeping those of any enclosing with_label which aren't overridden.
+  #
+  #   Vernier.with_label(controller: "UsersController", action: "show") { ... }
+  #
+  # Each distinct set of labels is kept for the life of the process, so
+  # they're best kept to values with few possibilities.
+  def self.with_label(**labels)
+    previous = _current_label_id
+    self._current_label_id = _label_id(previous, labels)
+    yield
+  ensure
+    self._current_label_id = previous if previous
+  end
+
   class Collector
     def self.new(mode, options = {})
       _new(mode, options)
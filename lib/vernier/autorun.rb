@@ -20,16 +20,30 @@ module Vernier
 
       STDERR.puts("starting profiler with interval #{interval}")
 
-      @collector = Vernier::Collector.new(:wall, interval:)
+      @collector = Vernier::Collector.new(:wall, interval:, window:)
       @collector.start
     end
 
+    # In flight recorder mode (VERNIER_WINDOW=seconds) the profiler is always
+    # running and the signal writes out the last window instead
+    def self.window
+      options[:window]&.to_f
+    end
+
+    def self.dump
+      write(@collector.dump)
+    end
+
     def self.stop
       result = @collector.stop
       @collector = nil
+      write(result)
+    end
+
+    def self.write(result)
       output_path = options[:output]
       output_path ||= Tempfile.create(["profile", ".vernier.json"]).path
-      File.write(output_path, Vernier::Output::Firefox.new(result).output)
+      result.write(out: output_path)
 
       STDERR.puts(result.inspect)
       STDERR.puts("written to #{output_path}")
@@ -44,17 +58,22 @@ module Vernier
     end
 
     def self.toggle
-      running? ? stop : start
+      if window && running?
+        dump
+      else
+        running? ? stop : start
+      end
     end
   end
 end
 
-unless Vernier::Autorun.options[:start_paused]
+if Vernier::Autorun.window || !Vernier::Autorun.options[:start_paused]
   Vernier::Autorun.start
 end
 
 if signal = Vernier::Autorun.options[:signal]
-  STDERR.puts "to toggle profiler: kill -#{signal} #{Process.pid}"
+  action = Vernier::Autorun.window ? "dump" : "toggle"
+  STDERR.puts "to #{action} profiler: kill -#{signal} #{Process.pid}"
   trap(signal) do
     Vernier::Autorun.toggle
   end
@@ -4,9 +4,23 @@ require_relative "marker"
 
 module Vernier
   class Collector
-    def initialize(mode)
+    class << self
+      # Collectors started and not yet stopped in this process
+      def running
+        @running ||= []
+      end
+    end
+
+    def initialize(mode, options = {})
       @mode = mode
       @markers = []
+      @window_ns = (options[:window] * 1_000_000_000).to_i if options[:window]
+    end
+
+    def start
+      start_collection
+      Collector.running << self
+      true
     end
 
     ##
@@ -20,6 +34,7 @@ module Vernier
     end
 
     def add_marker(name:, start:, finish:, thread: Thread.current.object_id, phase: Marker::Phase::INTERVAL, data: nil)
+      evict_markers if @window_ns
       @markers << [thread,
                    name,
                    start,
@@ -44,16 +59,81 @@ module Vernier
       )
     end
 
+    ##
+    # Flush a chunk every +every+ seconds while the collector runs, so that
+    # only the samples and markers since the last flush are held in memory.
+    # Each chunk, including the final one returned by #stop, is yielded to
+    # the block, or appended to +out+ (a path or IO) as a line of JSON. See
+    # Result#write_chunk and Result.read_chunks.
+    def stream(every: 10, out: nil, &on_chunk)
+      raise ArgumentError, "already streaming" if @flusher
+      raise ArgumentError, "needs out: or a block" unless out || on_chunk
+
+      unless on_chunk
+        io = out.respond_to?(:write) ? out : File.open(out, "a")
+        on_chunk = ->(chunk) { chunk.write_chunk(io); io.flush }
+      end
+      @on_chunk = on_chunk
+
+      @flusher_stop = Thread::Queue.new
+      @flusher = Thread.new do
+        until @flusher_stop.pop(timeout: every)
+          @on_chunk.call(flush)
+        end
+      end
+      @flusher.name = "Vernier flush"
+    end
+
+    ##
+    # Seal everything recorded since the last flush into a Result chunk and
+    # return it while collection continues.
+    def flush
+      finish_result(flush_chunk, markers)
+    end
+
+    ##
+    # For collectors created with a +window:+ (in seconds), returns a Result
+    # covering the last window of samples and markers. Collection continues.
+    def dump
+      result, raw_markers = dump_window
+      evict_markers
+      finish_result(result, raw_markers, consume: false)
+    end
+
     def stop
-      result = finish
+      if @flusher
+        @flusher_stop.push(true)
+        @flusher.join
+        @flusher = nil
+      end
+
+      result = finish_result(finish, markers)
+      Collector.running.delete(self)
+      @on_chunk&.call(result)
+      @on_chunk = nil
+      result
+    end
 
+    private
+
+    # Called by ForkHooks once fork returns. A wall or cpu collector in the
+    # child starts afresh, so markers and streaming (whose thread and output
+    # belong to the parent) don't carry over either.
+    def after_fork(child)
+      return unless fork_finished(child)
+
+      @markers = []
+      @flusher = @flusher_stop = @on_chunk = nil
+    end
+
+    def finish_result(result, raw_markers, consume: true)
       end_time = Process.clock_gettime(Process::CLOCK_REALTIME, :nanosecond)
       result.pid = Process.pid
       result.end_time = end_time
 
       marker_strings = Marker.name_table
 
-      markers = self.markers.map do |(tid, type, phase, ts, te, stack)|
+      markers = raw_markers.map do |(tid, type, phase, ts, te, stack)|
         name = marker_strings[type]
         sym = Marker::MARKER_SYMBOLS[type]
         data = { type: sym }
@@ -62,10 +142,17 @@ module Vernier
       end
 
       markers.concat @markers
+      @markers = [] if consume
 
       result.instance_variable_set(:@markers, markers)
 
       result
     end
+
+    # Markers are added roughly in order, so only look at the oldest ones
+    def evict_markers
+      cutoff = current_time - @window_ns
+      @markers.shift while @markers.first && (@markers.first[3] || @markers.first[2]) < cutoff
+    end
   end
 end
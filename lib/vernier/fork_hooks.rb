@@ -0,0 +1,23 @@
+# frozen_string_literal: true
+
+module Vernier
+  # Keeps running collectors working across fork, so that each worker of a
+  # forking server profiles itself. Collectors with background threads keep
+  # them clear of any locks while the process forks, and the child, which
+  # only has the forking thread left, then restarts them.
+  module ForkHooks
+    def _fork
+      collectors = Collector.running.dup
+      collectors.each { _1.send(:prepare_fork) }
+      pid = nil
+      begin
+        pid = super
+      ensure
+        collectors.each { _1.send(:after_fork, pid == 0) }
+      end
+      pid
+    end
+  end
+end
+
+Process.singleton_class.prepend(Vernier::ForkHooks)
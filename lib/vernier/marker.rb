@@ -26,6 +26,9 @@ module Vernier
     MARKER_STRINGS[Type::THREAD_STALLED] = "Thread Stalled"
     MARKER_STRINGS[Type::THREAD_SUSPENDED] = "Thread Suspended"
 
+    MARKER_STRINGS[Type::PROFILER_LATE_TICK] = "Profiler late tick"
+    MARKER_STRINGS[Type::PROFILER_SLOW_TICK] = "Profiler slow tick"
+
     MARKER_STRINGS.freeze
 
     ##
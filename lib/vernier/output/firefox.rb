@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require "json"
+require "zlib"
 
 module Vernier
   module Output
@@ -92,10 +93,40 @@ module Vernier
         ::JSON.generate(data)
       end
 
+      # Writes the same document as #output to an IO or a path, streaming it
+      # from the native extension rather than building it in memory first.
+      def write(out, gzip: false)
+        if !out.respond_to?(:write)
+          File.open(out, "wb") { |file| write(file, gzip:) }
+        elsif gzip
+          gz = Zlib::GzipWriter.new(out)
+          write(gz)
+          gz.finish
+        else
+          write_stream(out, profile, ::JSON.generate(meta), func_categories,
+                       gc_category.idx, thread_category.idx, profile.pid || Process.pid)
+        end
+        out
+      end
+
       private
 
       attr_reader :profile
 
+      def func_categories
+        profile.func_table.fetch(:filename).map do |filename|
+          @categorizer.categorize(filename).idx
+        end
+      end
+
+      def gc_category
+        @categorizer.get_category("GC")
+      end
+
+      def thread_category
+        @categorizer.get_category("Thread")
+      end
+
       def data
         markers_by_thread = profile.markers.group_by { |marker| marker[0] }
 
@@ -111,35 +142,39 @@ module Vernier
         end
 
         {
-          meta: {
-            interval: 1, # FIXME: memory vs wall
-            startTime: profile.started_at / 1_000_000.0,
-            #endTime: (profile.timestamps&.max || 0) / 1_000_000.0,
-            processType: 0,
-            product: "Ruby/Vernier",
-            stackwalk: 1,
-            version: 28,
-            preprocessedProfileVersion: 47,
-            symbolicated: true,
-            markerSchema: marker_schema,
-            sampleUnits: {
-              time: "ms",
-              eventDelay: "ms",
-              threadCPUDelta: "µs"
-            }, # FIXME: memory vs wall
-            categories: @categorizer.categories.map do |category|
-              {
-                name: category.name,
-                color: category.color,
-                subcategories: []
-              }
-            end
-          },
+          meta: meta,
           libs: [],
           threads: thread_data
         }
       end
 
+      def meta
+        {
+          interval: 1, # FIXME: memory vs wall
+          startTime: profile.started_at / 1_000_000.0,
+          #endTime: (profile.timestamps&.max || 0) / 1_000_000.0,
+          processType: 0,
+          product: "Ruby/Vernier",
+          stackwalk: 1,
+          version: 28,
+          preprocessedProfileVersion: 47,
+          symbolicated: true,
+          markerSchema: marker_schema,
+          sampleUnits: {
+            time: "ms",
+            eventDelay: "ms",
+            threadCPUDelta: "µs"
+          }, # FIXME: memory vs wall
+          categories: @categorizer.categories.map do |category|
+            {
+              name: category.name,
+              color: category.color,
+              subcategories: []
+            }
+          end
+        }
+      end
+
       def marker_schema
         [
           {
@@ -158,11 +193,12 @@ module Vernier
       class Thread
         attr_reader :profile
 
-        def initialize(ruby_thread_id, profile, categorizer, name:, tid:, samples:, weights:, timestamps: nil, sample_categories: nil, markers:, started_at:, stopped_at: nil)
+        def initialize(ruby_thread_id, profile, categorizer, name:, tid:, samples:, weights:, timestamps: nil, sample_categories: nil, sample_labels: nil, labels: nil, gvl: nil, markers:, started_at:, stopped_at: nil, pid: nil)
           @ruby_thread_id = ruby_thread_id
           @profile = profile
           @categorizer = categorizer
           @tid = tid
+          @pid = pid
           @name = name
 
           timestamps ||= [0] * samples.size
@@ -189,8 +225,11 @@ module Vernier
           end
 
           lines = profile.frame_table.fetch(:line)
+          frame_funcs = profile.frame_table.fetch(:func)
+
+          @frame_implementations = frame_funcs.zip(lines).map do |func_idx, line|
+            filename = filenames[func_idx]
 
-          @frame_implementations = filenames.zip(lines).map do |filename, line|
             # Must match strings in `src/profile-logic/profile-data.js`
             # inside the firefox profiler. See `getFriendlyStackTypeName`
             if filename == "<cfunc>"
@@ -206,9 +245,12 @@ module Vernier
             end
           end
 
-          @frame_categories = filenames.map do |filename|
+          func_categories = filenames.map do |filename|
             @categorizer.categorize(filename)
           end
+          @frame_categories = frame_funcs.map do |func_idx|
+            func_categories[func_idx]
+          end
         end
 
         def data
@@ -220,7 +262,7 @@ module Vernier
             registerTime: (@started_at - 0) / 1_000_000.0,
             unregisterTime: ((@stopped_at - 0) / 1_000_000.0 if @stopped_at),
             pausedRanges: [],
-            pid: profile.pid || Process.pid,
+            pid: @pid || profile.pid || Process.pid,
             tid: @tid,
             frameTable: frame_table,
             funcTable: func_table,
@@ -0,0 +1,33 @@
+# frozen_string_literal: true
+
+module Vernier
+  module Output
+    # Folded stacks, as read by flamegraph.pl, inferno and speedscope: one
+    # line per unique stack, its frames from the root separated by
+    # semicolons, then its total weight.
+    class Folded
+      def initialize(profile)
+        @profile = profile
+      end
+
+      def output
+        stack_weights = Hash.new(0)
+        @profile.samples.zip(@profile.weights) do |stack_idx, weight|
+          stack_weights[stack_idx] += weight
+        end
+
+        folded = Hash.new(0)
+        stack_weights.each do |stack_idx, weight|
+          frames = @profile.stack(stack_idx).frames.reverse
+          folded[frames.map(&:name).join(";")] += weight
+        end
+
+        s = +""
+        folded.sort.each do |stack, weight|
+          s << "#{stack} #{weight}\n"
+        end
+        s
+      end
+    end
+  end
+end
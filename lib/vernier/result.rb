@@ -1,12 +1,47 @@
+require "json"
+
 module Vernier
   class Result
-    attr_reader :stack_table, :frame_table, :func_table
+    # Collectors started with packed: true hand us integer columns as binary
+    # strings of native-endian values rather than arrays. They're unpacked the
+    # first time they're read. A negative value in a nullable column means nil.
+    PACKED_FORMATS = {
+      samples: "l*",
+      weights: "l*",
+      timestamps: "Q*",
+      sample_categories: "l*",
+      sample_labels: "l*",
+      parent: "l*",
+      frame: "l*",
+      func: "l*",
+      line: "l*",
+      first_line: "l*",
+    }.freeze
+    NULLABLE_COLUMNS = [:parent, :sample_labels].freeze
+
     attr_reader :markers
 
     attr_accessor :pid, :end_time
-    attr_accessor :threads
+    attr_writer :threads
     attr_accessor :meta
 
+    def stack_table
+      unpack_columns(@stack_table)
+    end
+
+    def frame_table
+      unpack_columns(@frame_table)
+    end
+
+    def func_table
+      unpack_columns(@func_table)
+    end
+
+    def threads
+      @threads&.each_value { unpack_columns(_1) }
+      @threads
+    end
+
     # TODO: remove these
     def weights; threads.values.flat_map { _1[:weights] }; end
     def samples; threads.values.flat_map { _1[:samples] }; end
@@ -24,8 +59,144 @@ module Vernier
       Output::Firefox.new(self).output
     end
 
-    def write(out:)
-      File.write(out, to_gecko)
+    # Writes the profile in the Firefox Profiler's format to a path or IO,
+    # gzipped if the path ends in .gz
+    def write(out:, gzip: out.to_s.end_with?(".gz"))
+      Output::Firefox.new(self).write(out, gzip:)
+    end
+
+    # Writes this chunk (see Collector#flush) to io as a single line of JSON.
+    # Chunks from one collector can be appended to the same file, in order,
+    # and read back with Result.read_chunks.
+    def write_chunk(io)
+      data = {
+        meta:,
+        pid:,
+        end_time:,
+        stack_table:,
+        frame_table:,
+        func_table:,
+        threads: threads.to_a,
+        markers:
+      }
+      io.write(JSON.generate(data), "\n")
+    end
+
+    # Reads chunks written by #write_chunk from a path or IO and concatenates
+    # them into one Result
+    def self.read_chunks(input)
+      return File.open(input) { read_chunks(_1) } unless input.respond_to?(:read)
+
+      chunks = input.each_line.map do |line|
+        data = JSON.parse(line, symbolize_names: true)
+
+        chunk = new
+        chunk.meta = data[:meta]
+        chunk.pid = data[:pid]
+        chunk.end_time = data[:end_time]
+        chunk.threads = data[:threads].to_h
+        %i[stack_table frame_table func_table markers].each do |key|
+          chunk.instance_variable_set(:"@#{key}", data[key])
+        end
+        chunk
+      end
+      concat(chunks)
+    end
+
+    # Concatenates the chunks flushed from a collector, in order, back into
+    # a single Result
+    def self.concat(chunks)
+      stack_table = { parent: [], frame: [] }
+      frame_table = { func: [], line: [] }
+      func_table = { name: [], filename: [], first_line: [] }
+      threads = {}
+      markers = []
+
+      chunks.each do |chunk|
+        if (info = chunk.meta[:chunk])
+          offsets = [info[:stack_offset], info[:frame_offset], info[:func_offset]]
+          sizes = [stack_table[:frame].size, frame_table[:func].size, func_table[:name].size]
+          raise ArgumentError, "chunk #{info[:index]} is out of order" unless offsets == sizes
+        end
+
+        [[stack_table, chunk.stack_table], [frame_table, chunk.frame_table], [func_table, chunk.func_table]].each do |table, delta|
+          table.each { |key, column| column.concat(delta.fetch(key)) }
+        end
+
+        chunk.threads.each do |id, thread|
+          if (existing = threads[id])
+            concat_labels(existing, thread)
+            existing[:gvl] = sum_gvl([existing[:gvl], thread[:gvl]].compact) if thread[:gvl]
+            %i[samples weights timestamps sample_categories].each do |key|
+              existing[key].concat(thread[key]) if thread[key]
+            end
+            existing[:stopped_at] = thread[:stopped_at] if thread[:stopped_at]
+            existing[:tid] = thread[:tid] unless thread[:tid] == 0
+          else
+            threads[id] = thread.transform_values { _1.is_a?(Array) ? _1.dup : _1 }
+          end
+        end
+
+        markers.concat(chunk.markers)
+      end
+
+      result = new
+      result.meta = chunks.first.meta.except(:chunk)
+      result.pid = chunks.first.pid
+      result.end_time = chunks.last.end_time
+      result.threads = threads
+      result.instance_variable_set(:@stack_table, stack_table)
+      result.instance_variable_set(:@frame_table, frame_table)
+      result.instance_variable_set(:@func_table, func_table)
+      result.instance_variable_set(:@markers, markers)
+      result
+    end
+
+    # Each chunk indexes its own label sets, so a later chunk's are found or
+    # added in the thread's and its sample_labels remapped to them
+    def self.concat_labels(thread, chunk_thread)
+      return unless thread[:labels] || chunk_thread[:labels]
+
+      labels = (thread[:labels] ||= [])
+      sample_labels = (thread[:sample_labels] ||= Array.new(thread[:samples].size))
+
+      remap = (chunk_thread[:labels] || []).map do |set|
+        labels.index(set) || (labels << set).size - 1
+      end
+      chunk_labels = chunk_thread[:sample_labels] || Array.new(chunk_thread[:samples].size)
+      sample_labels.concat(chunk_labels.map { _1 && remap.fetch(_1) })
+    end
+    private_class_method :concat_labels
+
+    # Sums the GVL tables of several threads, or of one thread's chunks, by
+    # stack. The result is ordered like each thread's, most stalled first.
+    def self.sum_gvl(tables)
+      columns = %i[stalled_ns suspended_ns stalls suspensions]
+      rows = Hash.new { |h, stack| h[stack] = [0] * columns.size }
+      histograms = { stall_histogram: [], suspend_histogram: [] }
+
+      tables.each do |gvl|
+        gvl[:stack].each_with_index do |stack, i|
+          row = rows[stack]
+          columns.each_with_index { |key, col| row[col] += gvl[key][i] }
+        end
+        histograms.each do |key, sum|
+          gvl[key].each_with_index { |count, bucket| sum[bucket] = (sum[bucket] || 0) + count }
+        end
+      end
+
+      sorted = rows.sort_by { |stack, row| [-row[0], stack || -1] }
+      table = { stack: sorted.map(&:first) }
+      columns.each_with_index { |key, col| table[key] = sorted.map { _2[col] } }
+      table.merge(histograms)
+    end
+
+    # How long threads waited to get the GVL back, and had been suspended
+    # beforehand, totalled over every thread by the stack they resumed at
+    # (nil where it isn't known). Collect with gvl_stacks: true for every
+    # wait to have a stack.
+    def gvl_table
+      self.class.sum_gvl(threads.values.filter_map { _1[:gvl] })
     end
 
     def elapsed_seconds
@@ -135,5 +306,18 @@ module Vernier
     def total_bytes
       weights.sum
     end
+
+    private
+
+    def unpack_columns(table)
+      table&.each do |key, column|
+        next unless String === column && PACKED_FORMATS.key?(key)
+
+        values = column.unpack(PACKED_FORMATS.fetch(key))
+        values.map! { _1 < 0 ? nil : _1 } if NULLABLE_COLUMNS.include?(key)
+        table[key] = values
+      end
+      table
+    end
   end
 end
@@ -1,6 +1,8 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "stringio"
+require "tempfile"
 
 class TestOutputFirefox < Minitest::Test
   def assert_valid_firefox_profile(profile)
@@ -151,4 +153,69 @@ class TestOutputFirefox < Minitest::Test
     markers = JSON.parse(output)["threads"].flat_map { _1["markers"]["data"] }
     assert_includes markers, {"type"=>"UserTiming", "entryType"=>"measure", "name"=>"custom"}
   end
+
+  def test_streamed_output_matches
+    result = Vernier.trace do |collector|
+      collector.record_interval("custom") do
+        Thread.new { sleep 0.01 }.join
+      end
+      GC.start
+    end
+
+    assert_streamed_output_matches(result)
+  end
+
+  def test_streamed_packed_output_matches
+    collector = Vernier::Collector.new(:wall, packed: true)
+    collector.start
+    Thread.new { sleep 0.01 }.join
+    result = collector.stop
+
+    assert_streamed_output_matches(result)
+  end
+
+  def test_streamed_retained_output_matches
+    retained = []
+    result = Vernier.trace_retained do
+      100.times { retained << Object.new }
+    end
+
+    assert_streamed_output_matches(result)
+  end
+
+  def test_streamed_gzip_output
+    result = Vernier.trace { sleep 0.01 }
+
+    Tempfile.create(["profile", ".json.gz"]) do |file|
+      result.write(out: file.path)
+      output = Zlib::GzipReader.open(file.path, &:read)
+      assert_valid_firefox_profile(output)
+    end
+  end
+
+  def test_streamed_output_raises_errors
+    result = Vernier.trace { sleep 0.01 }
+
+    io = Object.new
+    def io.write(*) = raise(IOError, "closed stream")
+    error = assert_raises(IOError) { Vernier::Output::Firefox.new(result).write(io) }
+    assert_equal "closed stream", error.message
+
+    result.threads.values.first[:weights] = []
+    error = assert_raises(RuntimeError) { Vernier::Output::Firefox.new(result).write(StringIO.new) }
+    assert_equal "weights don't match samples", error.message
+  end
+
+  def assert_streamed_output_matches(result)
+    io = StringIO.new
+    Vernier::Output::Firefox.new(result).write(io)
+    assert_valid_firefox_profile(io.string)
+
+    streamed = JSON.parse(io.string)
+    expected = JSON.parse(Vernier::Output::Firefox.new(result).output)
+
+    # Derived from the current wall clock time, so it drifts between calls
+    assert_in_delta expected["meta"].delete("startTime"), streamed["meta"].delete("startTime"), 1000
+    assert_equal expected, streamed
+  end
 end
@@ -0,0 +1,65 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestAllocationCollector < Minitest::Test
+  def allocate_objects(n)
+    i = 0
+    while i < n
+      Object.new
+      i += 1
+    end
+  end
+
+  def samples_in(result, method_name)
+    result.threads.values.sum do |thread|
+      thread[:samples].zip(thread[:weights]).sum do |stack_idx, weight|
+        labels = result.stack(stack_idx).frames.map(&:label)
+        labels.any? { _1.end_with?("##{method_name}") } ? weight : 0
+      end
+    end
+  end
+
+  def test_every_nth_allocation
+    collector = Vernier::Collector.new(:allocation, interval: 100)
+    collector.start
+    allocate_objects(100_000)
+    result = collector.stop
+
+    assert_valid_result result
+    assert_in_delta 100_000, samples_in(result, :allocate_objects), 1_000
+  end
+
+  def test_randomized_interval
+    collector = Vernier::Collector.new(:allocation, interval: 100, randomize: true)
+    collector.start
+    allocate_objects(100_000)
+    result = collector.stop
+
+    assert_valid_result result
+    assert_in_delta 100_000, samples_in(result, :allocate_objects), 10_000
+  end
+
+  def test_threads
+    collector = Vernier::Collector.new(:allocation, interval: 10)
+    collector.start
+    th = Thread.new { allocate_objects(10_000) }
+    th.join
+    allocate_objects(10_000)
+    result = collector.stop
+
+    assert_valid_result result
+    assert_includes result.threads.keys, th.object_id
+    assert_includes result.threads.keys, Thread.current.object_id
+    assert_in_delta 10_000, result.threads[th.object_id][:weights].sum, 100
+  end
+
+  def test_firefox_output
+    result = Vernier.trace(mode: :allocation, interval: 10) do
+      allocate_objects(1_000)
+    end
+
+    output = Vernier::Output::Firefox.new(result).output
+    assert_equal 1, JSON.parse(output)["threads"].size
+  end
+end
@@ -0,0 +1,89 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+class TestCpuCollector < Minitest::Test
+  def setup
+    skip "cpu mode requires Linux" unless RUBY_PLATFORM.include?("linux")
+  end
+
+  def busy_for(seconds)
+    finish = Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) + seconds
+    while Process.clock_gettime(Process::CLOCK_THREAD_CPUTIME_ID) < finish
+    end
+  end
+
+  def test_busy_thread
+    collector = Vernier::Collector.new(:cpu, interval: 1000)
+    collector.start
+    busy_for(0.1)
+    result = collector.stop
+
+    assert_valid_result result
+    assert_in_delta 100, result.threads[Thread.current.object_id][:weights].sum, 20
+  end
+
+  def test_sleeping_threads_arent_sampled
+    collector = Vernier::Collector.new(:cpu, interval: 1000)
+    collector.start
+    sleeper = Thread.new { sleep 0.1 }
+    busy = Thread.new { busy_for(0.05) }
+    sleeper.join
+    busy.join
+    result = collector.stop
+
+    assert_valid_result result
+    assert_operator result.threads[sleeper.object_id][:weights].sum, :<, 5
+    assert_in_delta 50, result.threads[busy.object_id][:weights].sum, 15
+    assert result.threads[busy.object_id][:stopped_at]
+  end
+
+  def test_alongside_wall_collector
+    cpu = Vernier::Collector.new(:cpu, interval: 100)
+    wall = Vernier::Collector.new(:wall, interval: 100)
+    cpu.start
+    wall.start
+    threads = 4.times.map { Thread.new { busy_for(0.05) } }
+    threads.each(&:join)
+    wall_result = wall.stop
+    cpu_result = cpu.stop
+
+    assert_valid_result wall_result
+    assert_valid_result cpu_result
+    threads.each do |th|
+      assert_operator cpu_result.threads[th.object_id][:weights].sum, :>, 0
+    end
+  end
+
+  def test_firefox_output
+    result = Vernier.trace(mode: :cpu) do
+      busy_for(0.01)
+    end
+
+    output = Vernier::Output::Firefox.new(result).output
+    assert_operator JSON.parse(output)["threads"].size, :>=, 1
+  end
+
+  def test_fork_restarts_collection_in_child
+    collector = Vernier::Collector.new(:cpu, interval: 1000)
+    collector.start
+    busy_for(0.05)
+
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      busy_for(0.1)
+      collector.stop.write_chunk(writer)
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    child = Vernier::Result.read_chunks(reader)
+    Process.wait(pid)
+    parent = collector.stop
+
+    assert_valid_result child
+    assert_in_delta 100, child.weights.sum, 25
+    assert_in_delta 50, parent.weights.sum, 20
+  end
+end
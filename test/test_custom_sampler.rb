@@ -14,4 +14,175 @@ class TestCustomSampler < Minitest::Test
     assert_valid_result result
     assert_equal 10, result.weights.sum
   end
+
+  def test_packed_result
+    collector = Vernier::Collector.new(:custom, packed: true)
+    collector.start
+    10.times do
+      collector.sample
+    end
+    result = collector.stop
+
+    assert_valid_result result
+    assert_equal 10, result.weights.sum
+    assert_includes result.stack_table[:parent], nil
+    assert_equal result.stack_table[:frame].size, result.stack_table[:parent].size
+    assert_kind_of Integer, result.threads.values[0][:timestamps][0]
+    assert_equal "#{self.class}##{__method__}", result.stack(result.samples[0]).frames[1].label
+  end
+
+  def test_lines_share_a_func
+    collector = Vernier::Collector.new(:custom)
+    collector.start
+    collector.sample
+    collector.sample
+    result = collector.stop
+
+    assert_valid_result result
+
+    frames = result.each_sample.map { |stack, _| stack.frames[1] }
+    assert_equal 2, frames.map(&:line).uniq.size
+    assert_equal 1, frames.map { _1.func.idx }.uniq.size
+    assert_equal "#{self.class}##{__method__}", frames[0].label
+  end
+
+  def recurse(n, &block) = n.zero? ? block.call : recurse(n - 1, &block)
+
+  def test_max_depth_keeps_leaf_frames
+    collector = Vernier::Collector.new(:custom, max_depth: 50)
+    collector.start
+    recurse(100) { collector.sample }
+    collector.sample
+    result = collector.stop
+
+    assert_valid_result result
+
+    deep, shallow = result.each_sample.map { |stack, _| stack.frames }
+    assert_equal 51, deep.size
+    assert_equal "Vernier::Collector#sample", deep.first.label
+    assert_equal "(truncated)", deep.last.label
+    assert_equal "#{self.class}#recurse", deep[-2].label
+
+    refute_includes shallow.map(&:label), "(truncated)"
+  end
+
+  def test_invalid_max_depth
+    assert_raises(ArgumentError) { Vernier::Collector.new(:custom, max_depth: 0) }
+  end
+
+  def test_many_samples_packed_and_unpacked
+    results = [false, true].map do |packed|
+      collector = Vernier::Collector.new(:custom, packed:)
+      collector.start
+      # Alternating lines, so that no samples are merged
+      10_000.times do
+        collector.sample
+        collector.sample
+      end
+      collector.stop
+    end
+
+    results.each { assert_valid_result _1 }
+    unpacked, packed = results.map { _1.threads.values.first }
+    assert_equal 20_000, unpacked[:samples].size
+    assert_equal unpacked[:timestamps].sort, unpacked[:timestamps]
+    assert_equal unpacked[:samples].each_slice(2).to_a.uniq.size, 1
+    assert_equal unpacked[:samples], packed[:samples]
+  end
+
+  def sample_a(collector) = collector.sample
+  def sample_b(collector) = collector.sample
+
+  def test_aggregate
+    collector = Vernier::Collector.new(:custom, aggregate: true)
+    collector.start
+    10_000.times do
+      sample_a(collector)
+      sample_b(collector)
+    end
+    result = collector.stop
+
+    assert_valid_result result
+    thread = result.threads.values.first
+    assert_equal 2, thread[:samples].size
+    assert_equal [10_000, 10_000], thread[:weights]
+    refute thread.key?(:timestamps)
+
+    folded = Vernier::Output::Folded.new(result).output.lines
+    assert_equal 2, folded.size
+    assert(folded.all? { _1.end_with?(";Vernier::Collector#sample 10000\n") })
+  end
+
+  def test_labels
+    collector = Vernier::Collector.new(:custom)
+    collector.start
+    sample_a(collector)
+    Vernier.with_label(controller: "UsersController") do
+      sample_a(collector)
+      Vernier.with_label(action: :show) { sample_a(collector) }
+      assert_raises(RuntimeError) { Vernier.with_label(action: :index) { raise "boom" } }
+      sample_a(collector)
+    end
+    sample_a(collector)
+    result = collector.stop
+
+    assert_valid_result result
+    thread = result.threads.values.first
+    assert_equal [nil, 0, 1, 0, nil], thread[:sample_labels]
+    assert_equal [{ controller: "UsersController" }, { controller: "UsersController", action: "show" }], thread[:labels]
+    assert_equal 0, Vernier._current_label_id
+  end
+
+  def test_labels_packed_and_aggregate
+    [{ packed: true }, { aggregate: true }].each do |options|
+      collector = Vernier::Collector.new(:custom, **options)
+      collector.start
+      3.times do
+        sample_a(collector)
+        Vernier.with_label(job: "A") { sample_a(collector) }
+      end
+      result = collector.stop
+
+      thread = result.threads.values.first
+      assert_equal [{ job: "A" }], thread[:labels]
+      labelled = thread[:weights].zip(thread[:sample_labels]).select { _2 == 0 }.sum(&:first)
+      assert_equal 3, labelled
+    end
+  end
+
+  def test_unlabelled_results_have_no_label_columns
+    collector = Vernier::Collector.new(:custom)
+    collector.start
+    sample_a(collector)
+    thread = collector.stop.threads.values.first
+
+    refute thread.key?(:sample_labels)
+    refute thread.key?(:labels)
+  end
+
+  def test_aggregate_rejected_for_retained
+    assert_raises(ArgumentError) { Vernier::Collector.new(:retained, aggregate: true) }
+  end
+
+  def test_merge_shares_tables
+    results = 2.times.map do
+      collector = Vernier::Collector.new(:custom)
+      collector.start
+      sample_a(collector)
+      sample_b(collector)
+      collector.stop
+    end
+    results[1].pid = results[0].pid + 1
+
+    merged = Vernier::Result.merge(results)
+    assert_valid_result merged
+    assert_equal results[0].stack_table[:frame].size, merged.stack_table[:frame].size
+    assert_equal results[0].func_table[:name].size, merged.func_table[:name].size
+    assert_equal 4, merged.weights.sum
+
+    first, second = merged.threads.values
+    assert_equal first[:samples], second[:samples]
+    assert_equal [results[0].pid, results[1].pid], [first[:pid], second[:pid]]
+    assert_equal [results[1].pid, 0], merged.threads.keys.last
+  end
 end
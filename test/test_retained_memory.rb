@@ -135,6 +135,21 @@ class TestRetainedMemory < Minitest::Test
     assert_equal expected, labels.grep(/#alloc_[abc]\z/)
   end
 
+  def test_retained_among_many_freed
+    retained = []
+
+    result = Vernier.trace_retained do
+      100_000.times { |i|
+        obj = Object.new
+        retained << obj if i % 1000 == 0
+        GC.start if i % 10_000 == 0
+      }
+    end
+
+    assert_operator result.total_bytes, :>=, 40 * 100
+    assert_operator result.total_bytes, :<, 40 * 200
+  end
+
   def test_nothing_retained_in_module_eval
     skip("WIP")
 
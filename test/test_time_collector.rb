@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "tempfile"
 
 class TestTimeCollector < Minitest::Test
   SLOW_RUNNER = ENV["GITHUB_ACTIONS"] && ENV["RUNNER_OS"] == "macOS"
@@ -76,6 +77,40 @@ class TestTimeCollector < Minitest::Test
     # TODO: some assertions on behaviour
   end
 
+  def test_many_sleeping_threads_are_idle_throughout
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    collector.start
+    threads = 30.times.map { Thread.new { sleep 2 * SLEEP_SCALE } }
+    threads.each(&:join)
+    result = collector.stop
+
+    assert_valid_result result
+    threads.each do |th|
+      thread = result.threads.fetch(th.object_id)
+      assert_similar 200, thread[:weights].sum
+      assert_operator thread[:samples].size, :<=, 3
+      assert_includes thread[:sample_categories], 1
+    end
+  end
+
+  def test_thread_still_sleeping_at_stop_is_idle
+    queue = Thread::Queue.new
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    collector.start
+    th = Thread.new { queue.pop }
+    two_slow_methods
+    result = collector.stop
+    queue.push(nil)
+    th.join
+
+    assert_valid_result result
+    thread = result.threads.fetch(th.object_id)
+    assert_similar 200, thread[:weights].sum
+    assert_includes thread[:sample_categories], 1
+    stack = result.stack(thread[:samples].last)
+    assert_includes stack.frames.map(&:label), "Thread::Queue#pop"
+  end
+
   def count_up_to(n)
     i = 0
     while i < n
@@ -96,6 +131,43 @@ class TestTimeCollector < Minitest::Test
     # TODO: some assertions on behaviour
   end
 
+  def test_gvl_stacks
+    collector = Vernier::Collector.new(:wall, gvl_stacks: true)
+    collector.start
+    threads = 2.times.map { Thread.new { count_up_to(10_000_000) } }
+    threads.each(&:join)
+    result = collector.stop
+
+    assert_valid_result result
+    table = result.gvl_table
+    assert_equal table[:stack].size, table[:stalled_ns].size
+    assert_equal table[:stalled_ns].sort.reverse, table[:stalled_ns]
+
+    busy = table[:stack].each_index.select do |i|
+      result.stack(table[:stack][i]).frames.map(&:label).include?("TestTimeCollector#count_up_to")
+    end
+    assert_operator busy.sum { table[:stalled_ns][_1] }, :>, 0
+
+    gvl = result.threads.fetch(threads[0].object_id)[:gvl]
+    assert_equal gvl[:stalls].sum, gvl[:stall_histogram].sum
+  end
+
+  def test_gvl_suspensions_use_suspended_stack
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    collector.start
+    th = Thread.new { slow_method }
+    th.join
+    result = collector.stop
+
+    gvl = result.threads.fetch(th.object_id)[:gvl]
+    slept = gvl[:stack].each_index.select do |i|
+      gvl[:stack][i] && result.stack(gvl[:stack][i]).frames.map(&:label).include?("TestTimeCollector#slow_method")
+    end
+    assert_equal 1, slept.sum { gvl[:suspensions][_1] }
+    assert_operator slept.sum { gvl[:suspended_ns][_1] }, :>=, SLEEP_SCALE * 1e9 * 0.9
+    assert_equal gvl[:suspensions].sum, gvl[:suspend_histogram].sum
+  end
+
   def test_many_threads
     50.times do
       collector = Vernier::Collector.new(:wall)
@@ -135,6 +207,362 @@ class TestTimeCollector < Minitest::Test
     assert_similar 200, outer_result.weights.sum
   end
 
+  def test_concurrent_collectors_share_samples
+    fast = Vernier::Collector.new(:wall, interval: 1000)
+    slow = Vernier::Collector.new(:wall, interval: 5000)
+    fast.start
+    slow.start
+    spin_for(0.2)
+    slow_result = slow.stop
+    fast_result = fast.stop
+
+    assert_valid_result fast_result
+    assert_valid_result slow_result
+
+    # Both cover the same time, so weigh about the same in intervals
+    assert_similar 200, fast_result.weights.sum
+    assert_similar 40, slow_result.weights.sum
+
+    assert_operator slow_result.meta[:profiler][:shared_samples], :>, 0
+  end
+
+  def test_stopping_one_collector_leaves_others_hooked
+    first = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    second = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    first.start
+    second.start
+    first.stop
+
+    GC.start
+    thread = Thread.new { slow_method }.tap(&:join)
+    result = second.stop
+
+    assert_valid_result result
+    assert_includes result.markers.map { _1[1] }, "GC pause"
+    assert_includes result.threads.keys, thread.object_id
+  end
+
+  def test_aggregate
+    result = Vernier.trace(interval: SAMPLE_SCALE_INTERVAL, aggregate: true) do
+      two_slow_methods
+    end
+
+    assert_valid_result result
+    assert_similar 200, result.weights.sum
+    assert_equal result.samples.uniq.size, result.samples.size
+    assert_nil result.threads.values.first[:timestamps]
+
+    top = Vernier::Output::Top.new(result).output
+    assert_match(/\tKernel#sleep$/, top)
+    assert result.to_gecko
+  end
+
+  def test_fork_restarts_collection_in_child
+    collector = Vernier::Collector.new(:wall, interval: 1000)
+    collector.start
+    collector.record_interval("before fork") { spin_for(0.05) }
+
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      spin_for(0.1)
+      collector.stop.write_chunk(writer)
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    child = Vernier::Result.read_chunks(reader)
+    Process.wait(pid)
+    parent = collector.stop
+
+    assert_valid_result child
+    assert_equal pid, child.pid
+    assert_similar 100, child.threads.values.sum { _1[:weights].sum }
+    refute_includes child.markers.map { _1[1] }, "before fork"
+    assert_includes parent.markers.map { _1[1] }, "before fork"
+
+    merged = Vernier::Result.merge([parent, child])
+    assert_valid_result merged
+    assert_equal parent.weights.sum + child.weights.sum, merged.weights.sum
+    assert_equal [Process.pid, pid].sort, merged.threads.values.map { _1[:pid] }.uniq.sort
+    assert_equal parent.threads.size + child.threads.size, merged.threads.size
+    merged.markers.each { assert_includes merged.threads.keys, _1[0] }
+
+    pids = JSON.parse(merged.to_gecko)["threads"].map { _1["pid"] }.uniq.sort
+    assert_equal [Process.pid, pid].sort, pids
+  end
+
+  def test_flush_chunks
+    # Garbage left by earlier tests mustn't set off a GC in the first chunk
+    GC.start
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    collector.start
+    slow_method
+    first = collector.flush
+    Thread.new { slow_method }.join
+    GC.start
+    last = collector.stop
+
+    assert_equal 0, first.meta[:chunk][:index]
+    assert_equal 1, last.meta[:chunk][:index]
+    assert_equal first.stack_table[:frame].size, last.meta[:chunk][:stack_offset]
+    assert_equal first.func_table[:name].size, last.meta[:chunk][:func_offset]
+
+    assert_similar 100, first.weights.sum
+    assert_similar 200, last.weights.sum
+    assert_includes last.markers.map { _1[1] }, "GC pause"
+    refute_includes first.markers.map { _1[1] }, "GC pause"
+
+    result = Vernier::Result.concat([first, last])
+    assert_valid_result result
+    assert_similar 300, result.weights.sum
+    assert_equal first.markers.size + last.markers.size, result.markers.size
+  end
+
+  def test_labels_across_chunks
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    collector.start
+    Vernier.with_label(job: "First") { slow_method }
+    first = collector.flush
+    Vernier.with_label(job: "Second") { slow_method }
+    Vernier.with_label(job: "First") { slow_method }
+    last = collector.stop
+
+    result = Vernier::Result.concat([first, last])
+    thread = result.threads[Thread.current.object_id]
+    assert_equal [{ job: "First" }, { job: "Second" }], thread[:labels]
+    assert_equal thread[:samples].size, thread[:sample_labels].size
+
+    tally = Hash.new(0)
+    thread[:weights].zip(thread[:sample_labels]) { tally[_2] += _1 }
+    assert_similar 200, tally[0]
+    assert_similar 100, tally[1]
+
+    assert_equal Vernier::Result.sum_gvl([first, last].map { _1.threads[Thread.current.object_id][:gvl] }), thread[:gvl]
+
+    # Labelled threads can still be written out
+    assert_equal result.threads.size, JSON.parse(result.to_gecko)["threads"].size
+  end
+
+  def test_flush_removes_stopped_threads
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    collector.start
+    short_lived = 20.times.map { Thread.new { sleep 0.001 }.tap(&:join) }
+    first = collector.flush
+    second = collector.flush
+    last = collector.stop
+
+    assert_operator first.meta[:profiler][:threads], :>, short_lived.size
+    assert_operator second.meta[:profiler][:threads], :<, short_lived.size
+    short_lived.each do |thread|
+      assert_includes first.threads.keys, thread.object_id
+      refute_includes second.threads.keys, thread.object_id
+      refute_includes last.threads.keys, thread.object_id
+    end
+
+    result = Vernier::Result.concat([first, second, last])
+    assert_valid_result result
+  end
+
+  def test_stream_chunks_to_file
+    Tempfile.create("chunks") do |file|
+      collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+      collector.start
+      collector.stream(every: SLEEP_SCALE / 2, out: file.path)
+      two_slow_methods
+      collector.stop
+
+      assert_operator File.readlines(file.path).size, :>, 1
+
+      result = Vernier::Result.read_chunks(file.path)
+      assert_valid_result result
+      assert_similar 200, result.threads[Thread.current.object_id][:weights].sum
+      output = Vernier::Output::Firefox.new(result).output
+      # main, flusher and the profiler's own thread
+      assert_equal 3, JSON.parse(output)["threads"].size
+    end
+  end
+
+  def test_window_dump
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL, window: SLEEP_SCALE)
+    collector.start
+    collector.record_interval("old") { slow_method }
+    slow_method
+    slow_method
+    result = collector.dump
+
+    assert_valid_result result
+    assert_similar 100, result.threads[Thread.current.object_id][:weights].sum
+    refute_includes result.markers.map { _1[1] }, "old"
+
+    slow_method
+    result = collector.stop
+    assert_valid_result result
+    assert_similar 100, result.weights.sum
+  end
+
+  def test_window_removes_stopped_threads
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL, window: SLEEP_SCALE)
+    collector.start
+    short_lived = 20.times.map { Thread.new { sleep 0.001 }.tap(&:join) }
+    slow_method
+    slow_method
+    result = collector.dump
+    collector.stop
+
+    assert_valid_result result
+    assert_operator result.meta[:profiler][:threads], :<, short_lived.size
+    short_lived.each do |thread|
+      refute_includes result.threads.keys, thread.object_id
+    end
+  end
+
+  def busy_at_depth(depth, seconds)
+    if depth > 0
+      busy_at_depth(depth - 1, seconds)
+    else
+      finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+      while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+      end
+    end
+  end
+
+  # Samples record lines, so this keeps to one stack throughout
+  def count_on_one_line(n) = (i = 0; i += 1 while i < n)
+
+  def test_window_limits_merged_sample_span
+    interval = SAMPLE_SCALE_INTERVAL
+    collector = Vernier::Collector.new(:wall, interval: interval, window: SLEEP_SCALE)
+    collector.start
+    # Only the merge span splits the samples of a single stack
+    count_on_one_line(20_000_000)
+    result = collector.dump
+    collector.stop
+
+    span = [0.01, SLEEP_SCALE / 16].max
+    weights = result.threads[Thread.current.object_id][:weights]
+    assert_operator weights.size, :>, 1
+    assert_operator weights.max, :<=, 2 * span / (interval / 1_000_000.0)
+  end
+
+  def test_window_compacts_stack_table
+    collector = Vernier::Collector.new(:wall, window: SLEEP_SCALE / 2)
+    collector.start
+    # Each call site gets its own 1500 stack nodes
+    busy_at_depth(1500, SLEEP_SCALE / 2)
+    busy_at_depth(1500, SLEEP_SCALE / 2)
+    busy_at_depth(1500, SLEEP_SCALE / 2)
+    slow_method
+    result = collector.dump
+    collector.stop
+
+    assert_valid_result result
+    # Without compaction all three would still be there
+    assert_operator result.stack_table[:frame].size, :<, 4000
+    # Recursing shares the same frame, which only needs marking once
+    assert_operator result.meta[:profiler][:marked_frames], :<, 100
+  end
+
+  def spin_for(seconds)
+    finish = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+    while Process.clock_gettime(Process::CLOCK_MONOTONIC) < finish
+    end
+  end
+
+  def alternate_a = spin_for(0.001)
+  def alternate_b = spin_for(0.001)
+
+  def test_target_overhead
+    collector = Vernier::Collector.new(:wall, interval: 1000, target_overhead: 0.001)
+    collector.start
+    150.times do
+      alternate_a
+      alternate_b
+    end
+    result = collector.stop
+
+    assert_valid_result result
+    # Ticks are stretched out as far as they go, but still weighted by the
+    # time they cover (less whatever came after the last one)
+    assert_operator result.samples.size, :<, 50
+    assert_in_delta 300, result.weights.sum, 80
+  end
+
+  def test_many_markers_in_order
+    collector = Vernier::Collector.new(:wall, interval: SAMPLE_SCALE_INTERVAL)
+    collector.start
+    2.times.map do
+      Thread.new { 2000.times { Thread.pass } }
+    end.each(&:join)
+    result = collector.stop
+
+    running = result.markers.select { _1[1] == "Thread Running" }
+    assert_operator running.size, :>, 2048
+    starts = result.markers.map { _1[2] }
+    assert_equal starts.sort, starts
+  end
+
+  def test_max_depth
+    collector = Vernier::Collector.new(:wall, interval: 1000, max_depth: 20)
+    collector.start
+    busy_at_depth(100, 0.05)
+    result = collector.stop
+
+    assert_valid_result result
+    stacks = result.each_sample.map { |stack, _| stack.frames }
+    refute_empty stacks
+    stacks.each do |frames|
+      assert_equal 21, frames.size
+      assert_equal "(truncated)", frames.last.label
+      assert_equal "#{self.class}#busy_at_depth", frames[-2].label
+    end
+  end
+
+  def test_native_frames
+    skip "native stacks require Linux" unless RUBY_PLATFORM.include?("linux")
+    require "zlib"
+    data = Random.new(1).bytes(1_000_000)
+
+    result = Vernier.trace(native: true, interval: 100) do
+      10.times { Zlib.deflate(data) }
+    end
+
+    assert_valid_result result
+    in_zlib = result.each_sample.count do |stack, _|
+      frames = stack.frames
+      ruby = frames.drop_while { _1.filename.match?(/\.so(\.|\z)/) }
+      ruby.size < frames.size && ruby.first&.label == "Zlib.deflate"
+    end
+    assert_operator in_zlib, :>, 0
+
+    assert_raises(ArgumentError) { Vernier::Collector.new(:custom, native: true) }
+  end
+
+  def test_profiler_stats
+    collector = Vernier::Collector.new(:wall, interval: 1000)
+    collector.start
+    spin_for(0.2)
+    result = collector.stop
+
+    stats = result.meta[:profiler]
+    assert_operator stats[:ticks], :>, 100
+    assert_operator stats[:late_ticks], :<=, stats[:ticks]
+    assert_operator stats[:signal_handler_ns], :>, 0
+    assert_operator stats[:sample_wait_ns], :>=, stats[:signal_handler_ns]
+    assert_operator stats[:tick_ns], :>=, stats[:sample_wait_ns]
+    assert_operator stats[:translate_ns], :>, 0
+    assert_operator stats[:stack_nodes], :>, 0
+    assert_operator stats[:stack_table_capacity], :>, stats[:stack_nodes]
+    assert_operator stats[:marked_frames], :>, 0
+    assert_operator stats[:marked_frames], :<=, stats[:stack_nodes]
+    assert_operator stats[:write_result_ns], :>, 0
+    assert_equal 1_000_000, stats[:interval_ns]
+
+    profiler = result.threads.values.find { _1[:name] == "Vernier profiler" }
+    assert_empty profiler[:samples]
+    assert_operator profiler[:tid], :>, 0
+  end
+
   ExpectedError = Class.new(StandardError)
   def test_raised_exceptions_will_output
     output_file = File.join(__dir__, "../tmp/exception_output.json")